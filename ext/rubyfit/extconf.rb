@@ -1,2 +1,12 @@
 require 'mkmf'
+have_func("rb_hash_new_capa", "ruby.h")
+have_func("rb_interned_str_cstr", "ruby.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+if have_header("ruby/io/buffer.h")
+  have_func("rb_io_buffer_get_bytes_for_reading", "ruby/io/buffer.h")
+end
+if have_header("sys/mman.h") && have_func("mmap", "sys/mman.h")
+  have_func("madvise", "sys/mman.h")
+end
+have_header("zlib.h") if have_library("z", "inflate")
 create_makefile("rubyfit/rubyfit")
@@ -118,13 +118,8 @@ FIT_UINT8 Fit_GetArch(void)
 
 const FIT_MESG_DEF *Fit_GetMesgDef(FIT_UINT16 global_mesg_num)
 {
-   FIT_UINT8 index;
-
-   for (index = 0; index < FIT_MESGS; index++)
-   {
-      if (fit_mesg_defs[index]->global_mesg_num == global_mesg_num)
-         return (FIT_MESG_DEF *) fit_mesg_defs[index];
-   }
+   if (global_mesg_num < FIT_MESG_NUM_DEFS)
+      return (FIT_MESG_DEF *) fit_mesg_defs_by_num[global_mesg_num];
 
    return (FIT_MESG_DEF *) FIT_NULL;
 }
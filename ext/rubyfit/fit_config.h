@@ -22,12 +22,19 @@
 #define FIT_USE_STDINT_H // Define to use stdint.h types. By default size in bytes of integer types assumed to be char=1, short=2, long=4.
 
 #define FIT_LOCAL_MESGS     16 // 1-16. Sets maximum number of local messages that can be decoded. Lower to minimize RAM requirements.
-#define FIT_ARCH_ENDIAN     FIT_ARCH_ENDIAN_LITTLE   // Set to correct endian for build architecture.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+   #define FIT_ARCH_ENDIAN     FIT_ARCH_ENDIAN_BIG   // Set to correct endian for build architecture.
+#else
+   #define FIT_ARCH_ENDIAN     FIT_ARCH_ENDIAN_LITTLE   // Set to correct endian for build architecture.
+#endif
 
 #define FIT_CONVERT_CHECK_CRC // Define to check file crc.
 #define FIT_CONVERT_CHECK_FILE_HDR_DATA_TYPE // Define to check file header for FIT data type.  Verifies file is FIT format before starting decode.
 #define FIT_CONVERT_TIME_RECORD // Define to support time records (compressed timestamp).
 #define FIT_CONVERT_MULTI_THREAD // Define to support multiple conversion threads.
+#if defined(__GNUC__) || defined(__clang__)
+   #define FIT_CONVERT_DEF_CACHE // Define to share compiled definitions between conversions.  Needs the __atomic builtins.
+#endif
 #define FIT_16BIT_MESG_LENGTH_SUPPORT
 
 #if defined(__cplusplus)
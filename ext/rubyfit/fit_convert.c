@@ -17,20 +17,570 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "fit_convert.h"
 #include "fit_crc.h"
 
+//////////////////////////////////////////////////////////////////////////////////
+// Private Definitions
+//////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__GNUC__)
+   #define FIT_CONVERT_BSWAP16(x)   __builtin_bswap16(x)
+   #define FIT_CONVERT_BSWAP32(x)   __builtin_bswap32(x)
+   #define FIT_CONVERT_BSWAP64(x)   __builtin_bswap64(x)
+#else
+   #define FIT_CONVERT_BSWAP16(x)   ((FIT_UINT16)(((x) >> 8) | ((x) << 8)))
+   #define FIT_CONVERT_BSWAP32(x)   ((((x) >> 24) & 0x000000FFUL) | (((x) >> 8) & 0x0000FF00UL) | (((x) << 8) & 0x00FF0000UL) | (((x) << 24) & 0xFF000000UL))
+   #define FIT_CONVERT_BSWAP64(x)   (((FIT_UINT64)FIT_CONVERT_BSWAP32((FIT_UINT32)(x)) << 32) | FIT_CONVERT_BSWAP32((FIT_UINT32)((x) >> 32)))
+#endif
+
+#if defined(FIT_CONVERT_DEF_CACHE)
+   #define FIT_CONVERT_DEF_CACHE_SIZE     256 // Must be a power of 2.
+   #define FIT_CONVERT_DEF_CACHE_PROBES   8
+
+   typedef struct
+   {
+      FIT_MESG_CONVERT convert;
+      FIT_CONVERT_PLAN plan;
+      FIT_UINT32 hash;
+      FIT_UINT16 def_size;
+      FIT_UINT8 def_bytes[]; // Definition bytes the entry was compiled from.
+   } FIT_CONVERT_DEF_CACHE_ENTRY;
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////
 // Private Variables
 //////////////////////////////////////////////////////////////////////////////////
 
+#if defined(FIT_CONVERT_DEF_CACHE)
+   static FIT_CONVERT_DEF_CACHE_ENTRY *def_cache[FIT_CONVERT_DEF_CACHE_SIZE]; // Compiled definitions shared by all conversions.
+#endif
+
 #if !defined(FIT_CONVERT_MULTI_THREAD)
    static FIT_CONVERT_STATE state_struct;
    #define state  (&state_struct)
 #endif
 
+//////////////////////////////////////////////////////////////////////////////////
+// Private Functions
+//////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////
+// Compiles the decode plan for a local message from its conversion
+// table.  Adjacent fields that land next to each other in the local
+// message are merged into a single copy run.
+///////////////////////////////////////////////////////////////////////
+static void FitConvert_CompilePlan(FIT_CONVERT_PLAN *plan, FIT_MESG_CONVERT *convert, const FIT_MESG_DEF *mesg_def)
+{
+   FIT_UINT8 swap = (convert->arch & FIT_ARCH_ENDIAN_MASK) != FIT_ARCH_ENDIAN;
+   FIT_UINT8 field_index;
+
+   #if defined(FIT_CONVERT_TIME_RECORD)
+      convert->timestamp_offset = Fit_GetFieldOffset(mesg_def, FIT_FIELD_NUM_TIMESTAMP);
+   #endif
+
+   plan->mesg_def = mesg_def;
+   plan->num_fills = 0;
+   plan->num_runs = 0;
+   plan->num_swaps = 0;
+   plan->num_strings = 0;
+   plan->invalid = FIT_FALSE;
+   plan->skip = FIT_FALSE;
+
+   #if defined(FIT_CONVERT_TIME_RECORD)
+      plan->timestamp_size = 0;
+   #endif
+
+   for (field_index = 0; field_index < convert->num_fields; field_index++)
+   {
+      const FIT_FIELD_CONVERT *field = &convert->fields[field_index];
+      FIT_CONVERT_RUN *run = (plan->num_runs > 0) ? &plan->runs[plan->num_runs - 1] : FIT_NULL;
+      FIT_UINT8 swap_size = 0;
+
+      // A zero-size field has no data to copy, and as a run it would never be
+      // reached by the byte-at-a-time decoder.
+      if (field->size == 0)
+         continue;
+
+      if ((run != FIT_NULL) &&
+          (field->offset_in == run->offset_in + run->size) &&
+          (field->offset_local == run->offset_local + run->size))
+      {
+         run->size += field->size;
+      }
+      else
+      {
+         run = &plan->runs[plan->num_runs++];
+         run->offset_in = field->offset_in;
+         run->offset_local = field->offset_local;
+         run->size = field->size;
+      }
+
+      if (swap && (field->base_type & FIT_BASE_TYPE_ENDIAN_FLAG))
+      {
+         FIT_UINT8 index = field->base_type & FIT_BASE_TYPE_NUM_MASK;
+
+         if (index >= FIT_BASE_TYPES)
+         {
+            plan->invalid = FIT_TRUE;
+         }
+         else if (fit_base_type_sizes[index] > 1)
+         {
+            FIT_UINT8 type_size = fit_base_type_sizes[index];
+            FIT_CONVERT_SWAP *swap_op = (plan->num_swaps > 0) ? &plan->swaps[plan->num_swaps - 1] : FIT_NULL;
+
+            swap_size = type_size;
+
+            if ((swap_op != FIT_NULL) &&
+                (swap_op->type_size == type_size) &&
+                (field->offset_local == swap_op->offset_local + swap_op->count * type_size))
+            {
+               swap_op->count += field->size / type_size;
+            }
+            else
+            {
+               swap_op = &plan->swaps[plan->num_swaps++];
+               swap_op->offset_local = field->offset_local;
+               swap_op->count = field->size / type_size;
+               swap_op->type_size = type_size;
+            }
+         }
+      }
+
+      if (field->base_type == FIT_BASE_TYPE_STRING)
+      {
+         plan->strings[plan->num_strings].offset_local = field->offset_local;
+         plan->strings[plan->num_strings].size = field->size;
+         plan->num_strings++;
+      }
+
+      #if defined(FIT_CONVERT_TIME_RECORD)
+         if (field->num == FIT_FIELD_NUM_TIMESTAMP)
+         {
+            plan->timestamp_in = field->offset_in;
+            plan->timestamp_size = field->size;
+            plan->timestamp_type_size = swap_size;
+         }
+      #endif
+   }
+
+   // Only the local bytes no run writes to need to be initialized per message.
+   if (Fit_InitMesg(mesg_def, plan->invalids))
+   {
+      FIT_UINT8 covered[FIT_MESG_SIZE];
+      FIT_UINT16 mesg_size = 0;
+      FIT_UINT16 offset;
+      FIT_UINT8 run;
+
+      for (field_index = 0; field_index < mesg_def->num_fields; field_index++)
+         mesg_size += mesg_def->fields[FIT_MESG_DEF_FIELD_OFFSET(size, field_index)];
+
+      memset(covered, 0, sizeof(covered));
+
+      for (run = 0; run < plan->num_runs; run++)
+         memset(&covered[plan->runs[run].offset_local], 1, plan->runs[run].size);
+
+      for (offset = 0; offset < mesg_size; offset++)
+      {
+         FIT_CONVERT_FILL *fill = (plan->num_fills > 0) ? &plan->fills[plan->num_fills - 1] : FIT_NULL;
+
+         if (covered[offset])
+            continue;
+
+         if ((fill != FIT_NULL) && (fill->offset_local + fill->size == offset))
+         {
+            fill->size++;
+         }
+         else
+         {
+            fill = &plan->fills[plan->num_fills++];
+            fill->offset_local = offset;
+            fill->size = 1;
+         }
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Reverse the byte order of count consecutive elements.  The loops are
+// written so the compiler can vectorize them.
+///////////////////////////////////////////////////////////////////////
+static void FitConvert_Swap16(FIT_UINT8 *data, FIT_UINT16 count)
+{
+   FIT_UINT16 element;
+
+   for (element = 0; element < count; element++)
+   {
+      FIT_UINT16 value;
+
+      memcpy(&value, &data[element * sizeof(value)], sizeof(value));
+      value = FIT_CONVERT_BSWAP16(value);
+      memcpy(&data[element * sizeof(value)], &value, sizeof(value));
+   }
+}
+
+static void FitConvert_Swap32(FIT_UINT8 *data, FIT_UINT16 count)
+{
+   FIT_UINT16 element;
+
+   for (element = 0; element < count; element++)
+   {
+      FIT_UINT32 value;
+
+      memcpy(&value, &data[element * sizeof(value)], sizeof(value));
+      value = FIT_CONVERT_BSWAP32(value);
+      memcpy(&data[element * sizeof(value)], &value, sizeof(value));
+   }
+}
+
+static void FitConvert_Swap64(FIT_UINT8 *data, FIT_UINT16 count)
+{
+   FIT_UINT16 element;
+
+   for (element = 0; element < count; element++)
+   {
+      FIT_UINT64 value;
+
+      memcpy(&value, &data[element * sizeof(value)], sizeof(value));
+      value = FIT_CONVERT_BSWAP64(value);
+      memcpy(&data[element * sizeof(value)], &value, sizeof(value));
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Applies the byte swaps and string fixups of a decode plan to a
+// message whose runs have been copied.
+///////////////////////////////////////////////////////////////////////
+static void FitConvert_FixupMesg(const FIT_CONVERT_PLAN *plan, FIT_UINT8 *mesg)
+{
+   FIT_UINT8 op;
+
+   for (op = 0; op < plan->num_swaps; op++)
+   {
+      FIT_UINT8 *field = &mesg[plan->swaps[op].offset_local];
+
+      switch (plan->swaps[op].type_size)
+      {
+         case 2:
+            FitConvert_Swap16(field, plan->swaps[op].count);
+            break;
+
+         case 4:
+            FitConvert_Swap32(field, plan->swaps[op].count);
+            break;
+
+         case 8:
+            FitConvert_Swap64(field, plan->swaps[op].count);
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   // Null terminate last character if multi-byte beyond end of field.
+   for (op = 0; op < plan->num_strings; op++)
+   {
+      FIT_UINT8 *field = &mesg[plan->strings[op].offset_local];
+      FIT_UINT8 length = plan->strings[op].size;
+      FIT_UINT8 index = 0;
+
+      while (index < length)
+      {
+         FIT_UINT8 char_size;
+         FIT_UINT8 size_mask = 0x80;
+
+         if (field[index] & size_mask)
+         {
+            char_size = 0;
+
+            while (field[index] & size_mask) // # of bytes in character = # of MSBits
+            {
+               char_size++;
+               size_mask >>= 1;
+            }
+         }
+         else
+         {
+            char_size = 1;
+         }
+
+         if ((FIT_UINT16)(index + char_size) > length)
+         {
+            while (index < length)
+            {
+               field[index++] = 0;
+            }
+            break;
+         }
+
+         index += char_size;
+      }
+   }
+}
+
+#if defined(FIT_CONVERT_TIME_RECORD)
+///////////////////////////////////////////////////////////////////////
+// Picks up the timestamp of the current message, if it has a valid one,
+// as the base for following compressed timestamp headers.
+///////////////////////////////////////////////////////////////////////
+static void FitConvert_UpdateTimestamp(FIT_CONVERT_STATE *convert_state)
+{
+   FIT_UINT16 timestamp_offset = convert_state->convert_table[convert_state->mesg_index].timestamp_offset;
+
+   if (timestamp_offset != FIT_UINT16_INVALID)
+   {
+      if (*((FIT_UINT32 *)&convert_state->u.mesg[timestamp_offset]) != FIT_DATE_TIME_INVALID)
+      {
+         memcpy(&convert_state->timestamp, &convert_state->u.mesg[timestamp_offset], sizeof(convert_state->timestamp));
+         convert_state->last_time_offset = (FIT_UINT8)(convert_state->timestamp & FIT_HDR_TIME_OFFSET_MASK);
+      }
+   }
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////
+// Finishes a data message once all of its runs have been copied.
+///////////////////////////////////////////////////////////////////////
+static FIT_CONVERT_RETURN FitConvert_EndMesg(FIT_CONVERT_STATE *convert_state)
+{
+   const FIT_CONVERT_PLAN *plan = &convert_state->plans[convert_state->mesg_index];
+
+   if (plan->invalid)
+      return FIT_CONVERT_ERROR;
+
+   FitConvert_FixupMesg(plan, convert_state->u.mesg);
+
+   #if defined(FIT_CONVERT_TIME_RECORD)
+      FitConvert_UpdateTimestamp(convert_state);
+
+      if (plan->clear_timestamp)
+      {
+         FIT_UINT16 timestamp_offset = convert_state->convert_table[convert_state->mesg_index].timestamp_offset;
+
+         memcpy(&convert_state->u.mesg[timestamp_offset], &plan->invalids[timestamp_offset], sizeof(convert_state->timestamp));
+      }
+   #endif
+
+   return FIT_CONVERT_MESSAGE_AVAILABLE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Builds the conversion table of the local message whose definition
+// just ended by looking its fields up in the local message definition.
+// Returns FIT_TRUE if the field filter dropped any of them.
+///////////////////////////////////////////////////////////////////////
+static FIT_BOOL FitConvert_BuildConvert(FIT_CONVERT_STATE *convert_state)
+{
+   FIT_MESG_CONVERT *convert = &convert_state->convert_table[convert_state->mesg_index];
+   const FIT_MESG_DEF *mesg_def = convert_state->mesg_def;
+   FIT_BOOL fields_filtered = FIT_FALSE;
+   FIT_UINT16 offset_in = 0;
+   FIT_UINT8 field_index;
+
+   convert->num_fields = 0;
+
+   for (field_index = 0; field_index < convert_state->num_fields; field_index++)
+   {
+      const FIT_UINT8 *field_def = &convert_state->def_bytes[FIT_CONVERT_DEF_HDR_SIZE + field_index * FIT_FIELD_DEF_SIZE];
+      FIT_UINT8 field_num = field_def[0];
+
+      if ((mesg_def != FIT_NULL) && (convert->num_fields < FIT_CONVERT_MAX_FIELDS))
+      {
+         FIT_UINT8 local_field_index;
+         FIT_UINT16 local_field_offset = 0;
+
+         // Search for the field definition in the local mesg definition.
+         for (local_field_index = 0; local_field_index < mesg_def->num_fields; local_field_index++)
+         {
+            FIT_UINT8 field_size = mesg_def->fields[FIT_MESG_DEF_FIELD_OFFSET(size, local_field_index)];
+
+            if (mesg_def->fields[FIT_MESG_DEF_FIELD_OFFSET(field_def_num, local_field_index)] == field_num)
+            {
+               FIT_FIELD_CONVERT *field = &convert->fields[convert->num_fields];
+
+               if ((convert_state->field_filter != FIT_UINT8_INVALID) &&
+                   ((convert_state->field_filters[convert_state->field_filter].fields[field_num / 8] & (1 << (field_num % 8))) == 0))
+               {
+                  fields_filtered = FIT_TRUE;
+
+                  #if defined(FIT_CONVERT_TIME_RECORD)
+                     // The timestamp is still needed for compressed timestamp headers.
+                     if (field_num != FIT_FIELD_NUM_TIMESTAMP)
+                        break;
+                  #else
+                     break;
+                  #endif
+               }
+
+               field->num = field_num;
+               field->offset_in = offset_in;
+               field->offset_local = local_field_offset;
+               field->size = field_def[1] < field_size ? field_def[1] : field_size;
+               field->base_type = field_def[2];
+               convert->num_fields++;
+               break;
+            }
+
+            local_field_offset += field_size;
+         }
+      }
+
+      offset_in += field_def[1];
+   }
+
+   return fields_filtered;
+}
+
+#if defined(FIT_CONVERT_DEF_CACHE)
+///////////////////////////////////////////////////////////////////////
+// Returns the cache entry for a definition, or FIT_NULL if it has not
+// been seen yet.
+///////////////////////////////////////////////////////////////////////
+static const FIT_CONVERT_DEF_CACHE_ENTRY *FitConvert_FindDef(const FIT_UINT8 *def_bytes, FIT_UINT16 def_size, FIT_UINT32 hash)
+{
+   FIT_UINT8 probe;
+
+   for (probe = 0; probe < FIT_CONVERT_DEF_CACHE_PROBES; probe++)
+   {
+      const FIT_CONVERT_DEF_CACHE_ENTRY *entry = __atomic_load_n(&def_cache[(hash + probe) & (FIT_CONVERT_DEF_CACHE_SIZE - 1)], __ATOMIC_ACQUIRE);
+
+      if (entry == FIT_NULL)
+         return FIT_NULL;
+
+      if ((entry->hash == hash) && (entry->def_size == def_size) && (memcmp(entry->def_bytes, def_bytes, def_size) == 0))
+         return entry;
+   }
+
+   return FIT_NULL;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Adds a compiled definition to the cache.  Entries are never replaced
+// or freed, as other conversions may be reading them; once the probed
+// slots are taken the definition is simply not cached.  That is
+// checked before allocating, so a full cache costs a definition no
+// more than FIT_CONVERT_DEF_CACHE_PROBES loads.
+///////////////////////////////////////////////////////////////////////
+static void FitConvert_AddDef(const FIT_UINT8 *def_bytes, FIT_UINT16 def_size, FIT_UINT32 hash, const FIT_MESG_CONVERT *convert, const FIT_CONVERT_PLAN *plan)
+{
+   FIT_CONVERT_DEF_CACHE_ENTRY *entry;
+   FIT_UINT8 probe;
+
+   for (probe = 0; probe < FIT_CONVERT_DEF_CACHE_PROBES; probe++)
+   {
+      if (__atomic_load_n(&def_cache[(hash + probe) & (FIT_CONVERT_DEF_CACHE_SIZE - 1)], __ATOMIC_RELAXED) == FIT_NULL)
+         break;
+   }
+
+   if (probe == FIT_CONVERT_DEF_CACHE_PROBES)
+      return;
+
+   entry = (FIT_CONVERT_DEF_CACHE_ENTRY *) malloc(sizeof(FIT_CONVERT_DEF_CACHE_ENTRY) + def_size);
+
+   if (entry == FIT_NULL)
+      return;
+
+   entry->hash = hash;
+   entry->def_size = def_size;
+   memcpy(entry->def_bytes, def_bytes, def_size);
+   memcpy(&entry->convert, convert, sizeof(entry->convert));
+   memcpy(&entry->plan, plan, sizeof(entry->plan));
+
+   for (probe = 0; probe < FIT_CONVERT_DEF_CACHE_PROBES; probe++)
+   {
+      FIT_CONVERT_DEF_CACHE_ENTRY *expected = FIT_NULL;
+
+      if (__atomic_compare_exchange_n(&def_cache[(hash + probe) & (FIT_CONVERT_DEF_CACHE_SIZE - 1)], &expected, entry, FIT_FALSE, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+         return;
+
+      if ((expected->hash == hash) && (expected->def_size == def_size) && (memcmp(expected->def_bytes, def_bytes, def_size) == 0))
+         break; // Added by another conversion in the meantime.
+   }
+
+   free(entry);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////
+// Builds the conversion table and plan of the local message whose
+// definition just ended and applies the message filter to it.
+///////////////////////////////////////////////////////////////////////
+static void FitConvert_EndDef(FIT_CONVERT_STATE *convert_state)
+{
+   FIT_MESG_CONVERT *convert;
+   FIT_CONVERT_PLAN *plan;
+   FIT_UINT16 global_mesg_num;
+   FIT_BOOL fields_filtered = FIT_FALSE;
+
+   if (convert_state->mesg_index >= FIT_LOCAL_MESGS)
+      return;
+
+   convert = &convert_state->convert_table[convert_state->mesg_index];
+   plan = &convert_state->plans[convert_state->mesg_index];
+   global_mesg_num = convert->global_mesg_num;
+
+   #if defined(FIT_CONVERT_DEF_CACHE)
+      // Only definitions that are converted the same way by every conversion are shared.
+      if ((convert_state->field_filter == FIT_UINT8_INVALID) && (convert_state->mesg_def == Fit_GetMesgDef(global_mesg_num)))
+      {
+         FIT_UINT16 def_size = FIT_CONVERT_DEF_HDR_SIZE + convert_state->num_fields * FIT_FIELD_DEF_SIZE;
+         FIT_UINT32 hash = 2166136261UL; // FNV-1a
+         const FIT_CONVERT_DEF_CACHE_ENTRY *entry;
+         FIT_UINT16 index;
+
+         for (index = 0; index < def_size; index++)
+            hash = (hash ^ convert_state->def_bytes[index]) * 16777619UL;
+
+         entry = FitConvert_FindDef(convert_state->def_bytes, def_size, hash);
+
+         if (entry != FIT_NULL)
+         {
+            convert->num_fields = entry->convert.num_fields;
+            convert->timestamp_offset = entry->convert.timestamp_offset;
+            memcpy(convert->fields, entry->convert.fields, entry->convert.num_fields * sizeof(FIT_FIELD_CONVERT));
+            memcpy(plan, &entry->plan, sizeof(*plan));
+         }
+         else
+         {
+            FitConvert_BuildConvert(convert_state);
+            FitConvert_CompilePlan(plan, convert, convert_state->mesg_def);
+            FitConvert_AddDef(convert_state->def_bytes, def_size, hash, convert, plan);
+         }
+      }
+      else
+   #endif
+   {
+      fields_filtered = FitConvert_BuildConvert(convert_state);
+      FitConvert_CompilePlan(plan, convert, convert_state->mesg_def);
+   }
+
+   // Messages are returned even if the field filter left nothing to convert.
+   plan->return_empty = fields_filtered;
+
+   if (convert_state->filter_mesgs)
+   {
+      plan->skip = (global_mesg_num >= FIT_MESG_NUM_DEFS) ||
+         ((convert_state->mesg_filter[global_mesg_num / 8] & (1 << (global_mesg_num % 8))) == 0);
+   }
+
+   #if defined(FIT_CONVERT_TIME_RECORD)
+      // A filtered out timestamp is still converted, see FIT_CONVERT_DECODE_FIELD_DEF.
+      plan->clear_timestamp = FIT_FALSE;
+
+      if ((convert_state->field_filter != FIT_UINT8_INVALID) &&
+          (convert_state->convert_table[convert_state->mesg_index].timestamp_offset != FIT_UINT16_INVALID))
+      {
+         const FIT_CONVERT_FIELD_FILTER *filter = &convert_state->field_filters[convert_state->field_filter];
+
+         plan->clear_timestamp = (filter->fields[FIT_FIELD_NUM_TIMESTAMP / 8] & (1 << (FIT_FIELD_NUM_TIMESTAMP % 8))) == 0;
+      }
+   #endif
+}
+
 //////////////////////////////////////////////////////////////////////////////////
 // Public Functions
 //////////////////////////////////////////////////////////////////////////////////
@@ -42,8 +592,33 @@
    void FitConvert_Init(FIT_BOOL read_file_header)
 #endif
 {
+   FIT_UINT8 index;
+
    state->mesg_offset = 0;
    state->data_offset = 0;
+   state->defined_mesgs = 0;
+   memset(state->mesg_sizes, 0, sizeof(state->mesg_sizes));
+   memset(state->dev_data_sizes, 0, sizeof(state->dev_data_sizes));
+
+   for (index = 0; index < FIT_LOCAL_MESGS; index++)
+   {
+      state->convert_table[index].num_fields = 0;
+      state->convert_table[index].timestamp_offset = FIT_UINT16_INVALID;
+      state->plans[index].mesg_def = FIT_NULL;
+      state->plans[index].num_fills = 0;
+      state->plans[index].num_runs = 0;
+      state->plans[index].skip = FIT_FALSE;
+      state->plans[index].clear_timestamp = FIT_FALSE;
+      state->plans[index].return_empty = FIT_FALSE;
+
+      #if defined(FIT_CONVERT_TIME_RECORD)
+         state->plans[index].timestamp_size = 0;
+      #endif
+   }
+
+   state->filter_mesgs = FIT_FALSE;
+   state->num_field_filters = 0;
+   state->field_filter = FIT_UINT8_INVALID;
 
 #if defined(FIT_CONVERT_CHECK_CRC)
    state->crc = 0;
@@ -65,6 +640,61 @@
    }
 }
 
+///////////////////////////////////////////////////////////////////////
+#if defined(FIT_CONVERT_MULTI_THREAD)
+   void FitConvert_SetMessageFilter(FIT_CONVERT_STATE *state, const FIT_UINT16 *mesg_nums, FIT_UINT16 num_mesgs)
+#else
+   void FitConvert_SetMessageFilter(const FIT_UINT16 *mesg_nums, FIT_UINT16 num_mesgs)
+#endif
+{
+   FIT_UINT16 index;
+
+   state->filter_mesgs = (mesg_nums != FIT_NULL);
+   memset(state->mesg_filter, 0, sizeof(state->mesg_filter));
+
+   if (mesg_nums == FIT_NULL)
+      return;
+
+   for (index = 0; index < num_mesgs; index++)
+   {
+      if (mesg_nums[index] < FIT_MESG_NUM_DEFS)
+         state->mesg_filter[mesg_nums[index] / 8] |= (FIT_UINT8)(1 << (mesg_nums[index] % 8));
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+#if defined(FIT_CONVERT_MULTI_THREAD)
+   FIT_BOOL FitConvert_SetFieldFilter(FIT_CONVERT_STATE *state, FIT_UINT16 global_mesg_num, const FIT_UINT8 *field_nums, FIT_UINT8 num_fields)
+#else
+   FIT_BOOL FitConvert_SetFieldFilter(FIT_UINT16 global_mesg_num, const FIT_UINT8 *field_nums, FIT_UINT8 num_fields)
+#endif
+{
+   FIT_CONVERT_FIELD_FILTER *filter = FIT_NULL;
+   FIT_UINT8 index;
+
+   for (index = 0; index < state->num_field_filters; index++)
+   {
+      if (state->field_filters[index].global_mesg_num == global_mesg_num)
+         filter = &state->field_filters[index];
+   }
+
+   if (filter == FIT_NULL)
+   {
+      if (state->num_field_filters >= FIT_CONVERT_FIELD_FILTERS)
+         return FIT_FALSE;
+
+      filter = &state->field_filters[state->num_field_filters++];
+      filter->global_mesg_num = global_mesg_num;
+   }
+
+   memset(filter->fields, 0, sizeof(filter->fields));
+
+   for (index = 0; index < num_fields; index++)
+      filter->fields[field_nums[index] / 8] |= (FIT_UINT8)(1 << (field_nums[index] % 8));
+
+   return FIT_TRUE;
+}
+
 ///////////////////////////////////////////////////////////////////////
 #if defined(FIT_CONVERT_MULTI_THREAD)
    FIT_CONVERT_RETURN FitConvert_Read(FIT_CONVERT_STATE *state, const void *data, FIT_UINT32 size)
@@ -186,6 +816,7 @@
                      state->has_dev_data = FIT_TRUE;
                   }
 
+                  state->defined_mesgs |= 1 << state->mesg_index;
                   state->mesg_sizes[state->mesg_index] = 0;
                   state->dev_data_sizes[state->mesg_index] = 0;
                   state->decode_state = FIT_CONVERT_DECODE_RESERVED1;
@@ -194,20 +825,45 @@
 
             if (state->decode_state == FIT_CONVERT_DECODE_FIELD_DATA)
             {
+               // Data for a local message that was never defined has no known size.
+               if ((state->defined_mesgs & (1 << state->mesg_index)) == 0)
+                  return FIT_CONVERT_ERROR;
+
                if (state->mesg_index < FIT_LOCAL_MESGS)
                {
-                  state->mesg_def = Fit_GetMesgDef(state->convert_table[state->mesg_index].global_mesg_num);
-                  Fit_InitMesg(state->mesg_def, state->u.mesg);
+                  const FIT_CONVERT_PLAN *plan = &state->plans[state->mesg_index];
+                  FIT_UINT8 fill;
 
-                  #if defined(FIT_CONVERT_TIME_RECORD)
-                     if (datum & FIT_HDR_TIME_REC_BIT)
-                     {
-                        FIT_UINT16 field_offset = Fit_GetFieldOffset(state->mesg_def, FIT_FIELD_NUM_TIMESTAMP);
+                  state->mesg_def = plan->mesg_def;
 
-                        if (field_offset != FIT_UINT16_INVALID)
-                           memcpy(&state->u.mesg[field_offset], &state->timestamp, sizeof(state->timestamp));
-                     }
-                  #endif
+                  if (plan->skip)
+                  {
+                     state->decode_state = FIT_CONVERT_DECODE_SKIP_DATA;
+
+                     #if defined(FIT_CONVERT_TIME_RECORD)
+                        if (plan->timestamp_size > 0)
+                        {
+                           FIT_UINT16 field_offset = state->convert_table[state->mesg_index].timestamp_offset;
+
+                           memcpy(&state->u.mesg[field_offset], &plan->invalids[field_offset], sizeof(state->timestamp));
+                        }
+                     #endif
+                  }
+                  else
+                  {
+                     for (fill = 0; fill < plan->num_fills; fill++)
+                        memcpy(&state->u.mesg[plan->fills[fill].offset_local], &plan->invalids[plan->fills[fill].offset_local], plan->fills[fill].size);
+
+                     #if defined(FIT_CONVERT_TIME_RECORD)
+                        if (datum & FIT_HDR_TIME_REC_BIT)
+                        {
+                           FIT_UINT16 field_offset = state->convert_table[state->mesg_index].timestamp_offset;
+
+                           if (field_offset != FIT_UINT16_INVALID)
+                              memcpy(&state->u.mesg[field_offset], &state->timestamp, sizeof(state->timestamp));
+                        }
+                     #endif
+                  }
                }
 
                if (state->mesg_sizes[state->mesg_index] == 0)
@@ -243,6 +899,8 @@
          case FIT_CONVERT_DECODE_GTYPE_2:
             if (state->mesg_index < FIT_LOCAL_MESGS)
             {
+               FIT_UINT8 field_filter;
+
                if ((state->convert_table[state->mesg_index].arch & FIT_ARCH_ENDIAN_MASK) == FIT_ARCH_ENDIAN_BIG)
                {
                   state->convert_table[state->mesg_index].global_mesg_num <<= 8;
@@ -255,6 +913,13 @@
 
                state->convert_table[state->mesg_index].num_fields = 0; // Initialize.
                state->mesg_def = Fit_GetMesgDef(state->convert_table[state->mesg_index].global_mesg_num);
+               state->field_filter = FIT_UINT8_INVALID;
+
+               for (field_filter = 0; field_filter < state->num_field_filters; field_filter++)
+               {
+                  if (state->field_filters[field_filter].global_mesg_num == state->convert_table[state->mesg_index].global_mesg_num)
+                     state->field_filter = field_filter;
+               }
             }
 
             state->decode_state = FIT_CONVERT_DECODE_NUM_FIELD_DEFS;
@@ -263,8 +928,18 @@
          case FIT_CONVERT_DECODE_NUM_FIELD_DEFS:
             state->num_fields = datum;
 
+            if (state->mesg_index < FIT_LOCAL_MESGS)
+            {
+               state->def_bytes[0] = state->convert_table[state->mesg_index].arch;
+               state->def_bytes[1] = (FIT_UINT8)state->convert_table[state->mesg_index].global_mesg_num;
+               state->def_bytes[2] = (FIT_UINT8)(state->convert_table[state->mesg_index].global_mesg_num >> 8);
+               state->def_bytes[3] = state->num_fields;
+            }
+
             if (state->num_fields == 0)
             {
+               FitConvert_EndDef(state);
+
                state->decode_state = state->has_dev_data ?
                   FIT_CONVERT_DECODE_NUM_DEV_FIELDS : FIT_CONVERT_DECODE_RECORD;
                break;
@@ -284,66 +959,27 @@
             break;
 
          case FIT_CONVERT_DECODE_FIELD_DEF:
-            state->field_num = FIT_FIELD_NUM_INVALID;
-
-            if (state->mesg_index < FIT_LOCAL_MESGS)
-            {
-               if (state->mesg_def != FIT_NULL)
-               {
-                  FIT_UINT8 local_field_index;
-                  FIT_UINT16 local_field_offset = 0;
-
-                  // Search for the field definition in the local mesg definition.
-                  for (local_field_index = 0; local_field_index < state->mesg_def->num_fields; local_field_index++)
-                  {
-                     FIT_UINT8 field_size = state->mesg_def->fields[FIT_MESG_DEF_FIELD_OFFSET(size, local_field_index)];
-
-                     if (state->mesg_def->fields[FIT_MESG_DEF_FIELD_OFFSET(field_def_num, local_field_index)] == datum)
-                     {
-                        state->field_num = datum;
-                        state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].num = state->field_num;
-                        state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].offset_in = state->mesg_offset;
-                        state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].offset_local = local_field_offset;
-                        state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].size = field_size;
-                        break;
-                     }
-
-                     local_field_offset += field_size;
-                  }
-               }
-            }
-
+            state->def_bytes[FIT_CONVERT_DEF_HDR_SIZE + state->field_index * FIT_FIELD_DEF_SIZE] = datum;
             state->decode_state = FIT_CONVERT_DECODE_FIELD_DEF_SIZE;
             break;
 
          case FIT_CONVERT_DECODE_FIELD_DEF_SIZE:
-            if (state->mesg_index < FIT_LOCAL_MESGS)
-            {
-               state->mesg_offset += datum;
-
-               if (state->field_num != FIT_FIELD_NUM_INVALID)
-               {
-                  if (datum < state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].size)
-                     state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].size = datum;
-               }
+            state->def_bytes[FIT_CONVERT_DEF_HDR_SIZE + state->field_index * FIT_FIELD_DEF_SIZE + 1] = datum;
 
+            if (state->mesg_index < FIT_LOCAL_MESGS)
                state->mesg_sizes[state->mesg_index] += datum;
-            }
 
             state->decode_state = FIT_CONVERT_DECODE_FIELD_BASE_TYPE;
             break;
 
          case FIT_CONVERT_DECODE_FIELD_BASE_TYPE:
-            if (state->field_num != FIT_FIELD_NUM_INVALID)
-            {
-               state->convert_table[state->mesg_index].fields[state->convert_table[state->mesg_index].num_fields].base_type = datum;
-               state->convert_table[state->mesg_index].num_fields++;
-            }
-
+            state->def_bytes[FIT_CONVERT_DEF_HDR_SIZE + state->field_index * FIT_FIELD_DEF_SIZE + 2] = datum;
             state->field_index++;
 
             if (state->field_index >= state->num_fields)
             {
+               FitConvert_EndDef(state);
+
                state->decode_state = state->has_dev_data ?
                   FIT_CONVERT_DECODE_NUM_DEV_FIELDS : FIT_CONVERT_DECODE_RECORD;
             }
@@ -388,6 +1024,48 @@
             break;
 
          case FIT_CONVERT_DECODE_FIELD_DATA:
+            if ((state->mesg_offset == 0) && (state->mesg_index < FIT_LOCAL_MESGS))
+            {
+               // The first byte of the message is datum.  If the rest of the record is already
+               // in the buffer and does not run into the file CRC, consume it in one step.
+               FIT_UINT32 mesg_size = (FIT_UINT32)state->mesg_sizes[state->mesg_index] + state->dev_data_sizes[state->mesg_index];
+
+               if ((size - state->data_offset >= mesg_size - 1) &&
+                   ((state->file_bytes_left == 0) || (state->file_bytes_left >= mesg_size + 1)))
+               {
+                  const FIT_UINT8 *mesg_data = (const FIT_UINT8 *) data + state->data_offset - 1;
+                  const FIT_CONVERT_PLAN *plan = &state->plans[state->mesg_index];
+
+                  if (state->file_bytes_left > 0)
+                  {
+                     #if defined(FIT_CONVERT_CHECK_CRC)
+                        state->crc = FitCRC_Update16(state->crc, mesg_data + 1, mesg_size - 1);
+                     #endif
+
+                     state->file_bytes_left -= mesg_size - 1;
+                  }
+
+                  state->data_offset += mesg_size - 1;
+                  state->mesg_offset = state->mesg_sizes[state->mesg_index];
+                  state->decode_state = FIT_CONVERT_DECODE_RECORD;
+
+                  if ((state->mesg_def != FIT_NULL) && ((plan->num_runs > 0) || plan->return_empty))
+                  {
+                     FIT_UINT8 run;
+
+                     for (run = 0; run < plan->num_runs; run++)
+                        memcpy(&state->u.mesg[plan->runs[run].offset_local], &mesg_data[plan->runs[run].offset_in], plan->runs[run].size);
+
+                     return FitConvert_EndMesg(state);
+                  }
+
+                  if (state->dev_data_sizes[state->mesg_index] > 0)
+                     return FIT_CONVERT_MESSAGE_AVAILABLE;
+
+                  break;
+               }
+            }
+
             state->mesg_offset++;
 
             if (state->mesg_offset >= state->mesg_sizes[state->mesg_index])
@@ -405,112 +1083,40 @@
 
             if (state->mesg_index < FIT_LOCAL_MESGS)
             {
-               if ((state->mesg_def != FIT_NULL) && (state->field_index < state->convert_table[state->mesg_index].num_fields))
+               const FIT_CONVERT_PLAN *plan = &state->plans[state->mesg_index];
+
+               if (state->mesg_def != FIT_NULL)
                {
-                  if (state->mesg_offset == (state->convert_table[state->mesg_index].fields[state->field_index].offset_in + state->field_offset + 1))
-                  {
-                     FIT_UINT8 *field = &state->u.mesg[state->convert_table[state->mesg_index].fields[state->field_index].offset_local];
+                  FIT_BOOL mesg_done = FIT_FALSE;
 
-                     field[state->field_offset] = datum; // Store the incoming byte in the local mesg buffer.
-                     state->field_offset++;
+                  if (state->field_index < plan->num_runs)
+                  {
+                     const FIT_CONVERT_RUN *run = &plan->runs[state->field_index];
 
-                     if (state->field_offset >= state->convert_table[state->mesg_index].fields[state->field_index].size)
+                     if (state->mesg_offset > run->offset_in)
                      {
-                        if (
-                              (state->convert_table[state->mesg_index].fields[state->field_index].base_type & FIT_BASE_TYPE_ENDIAN_FLAG) &&
-                              ((state->convert_table[state->mesg_index].arch & FIT_ARCH_ENDIAN_MASK) != (Fit_GetArch() & FIT_ARCH_ENDIAN_MASK))
-                           )
-                        {
-                           FIT_UINT8 type_size;
-                           FIT_UINT8 element_size;
-                           FIT_UINT8 element;
-                           FIT_UINT8 index;
-
-                           index = state->convert_table[state->mesg_index].fields[state->field_index].base_type & FIT_BASE_TYPE_NUM_MASK;
-
-                           if (index >= FIT_BASE_TYPES)
-                              return FIT_CONVERT_ERROR;
-
-                           type_size = fit_base_type_sizes[index];
-                           element_size = state->convert_table[state->mesg_index].fields[state->field_index].size / type_size;
-
-                           for (element = 0; element < element_size; element++)
-                           {
-                              for (index = 0; index < (type_size / 2); index++)
-                              {
-                                 FIT_UINT8 tmp = field[element * type_size + index];
-                                 field[element * type_size + index] = field[element * type_size + type_size - 1 - index];
-                                 field[element * type_size + type_size - 1 - index] = tmp;
-                              }
-                           }
-                        }
+                        // Store the incoming byte in the local mesg buffer.
+                        state->u.mesg[run->offset_local + state->mesg_offset - 1 - run->offset_in] = datum;
 
-                        // Null terminate last character if multi-byte beyond end of field.
-                        if (state->convert_table[state->mesg_index].fields[state->field_index].base_type == FIT_BASE_TYPE_STRING)
-                        {
-                           FIT_UINT8 length = state->convert_table[state->mesg_index].fields[state->field_index].size;
-                           FIT_UINT8 index = 0;
-
-                           while (index < length)
-                           {
-                              FIT_UINT8 char_size;
-                              FIT_UINT8 size_mask = 0x80;
-
-                              if (field[index] & size_mask)
-                              {
-                                 char_size = 0;
-
-                                 while (field[index] & size_mask) // # of bytes in character = # of MSBits
-                                 {
-                                    char_size++;
-                                    size_mask >>= 1;
-                                 }
-                              }
-                              else
-                              {
-                                 char_size = 1;
-                              }
-
-                              if ((FIT_UINT16)(index + char_size) > length)
-                              {
-                                 while (index < length)
-                                 {
-                                    field[index++] = 0;
-                                 }
-                                 break;
-                              }
-
-                              index += char_size;
-                           }
-                        }
+                        if (state->mesg_offset >= run->offset_in + run->size)
+                           state->field_index++; // Move on to the next run.
 
-                        state->field_offset = 0; // Reset the offset.
-                        state->field_index++; // Move on to the next field.
+                        mesg_done = (state->field_index >= plan->num_runs);
+                     }
+                  }
+                  else if ((plan->num_runs == 0) && plan->return_empty)
+                  {
+                     mesg_done = (state->mesg_offset == state->mesg_sizes[state->mesg_index]);
+                  }
 
-                        if (state->field_index >= state->convert_table[state->mesg_index].num_fields)
-                        {
-                           #if defined(FIT_CONVERT_TIME_RECORD)
-                              {
-                                 FIT_UINT16 timestamp_offset = Fit_GetFieldOffset(state->mesg_def, FIT_FIELD_NUM_TIMESTAMP);
-
-                                 if (timestamp_offset != FIT_UINT16_INVALID)
-                                 {
-                                    if (*((FIT_UINT32 *)&state->u.mesg[timestamp_offset]) != FIT_DATE_TIME_INVALID)
-                                    {
-                                       memcpy(&state->timestamp, &state->u.mesg[timestamp_offset], sizeof(state->timestamp));
-                                       state->last_time_offset = (FIT_UINT8)(state->timestamp & FIT_HDR_TIME_OFFSET_MASK);
-                                    }
-                                 }
-                              }
-                           #endif
-
-                           state->field_index = 0;
-                           if ( state->dev_data_sizes[state->mesg_index] == 0 )
-                           {
-                              // We have successfully decoded a mesg and there is no dev data to read.
-                              return FIT_CONVERT_MESSAGE_AVAILABLE;
-                           }
-                        }
+                  if (mesg_done)
+                  {
+                     FIT_CONVERT_RETURN convert_return = FitConvert_EndMesg(state);
+
+                     if ((convert_return == FIT_CONVERT_ERROR) || (state->dev_data_sizes[state->mesg_index] == 0))
+                     {
+                        // We have successfully decoded a mesg and there is no dev data to read.
+                        return convert_return;
                      }
                   }
                }
@@ -529,6 +1135,80 @@
             }
             break;
 
+         case FIT_CONVERT_DECODE_SKIP_DATA:
+            {
+               // datum is a byte of a filtered out message.  Skip as much of the rest
+               // of the message as the buffer holds, without running into the file CRC.
+               const FIT_CONVERT_PLAN *plan = &state->plans[state->mesg_index];
+               const FIT_UINT8 *skip_data = (const FIT_UINT8 *) data + state->data_offset - 1;
+               FIT_UINT16 mesg_size = state->mesg_sizes[state->mesg_index] + state->dev_data_sizes[state->mesg_index];
+               FIT_UINT32 skip_size = mesg_size - state->mesg_offset;
+
+               if (skip_size > size - state->data_offset + 1)
+                  skip_size = size - state->data_offset + 1;
+
+               if ((state->file_bytes_left > 0) && (skip_size > state->file_bytes_left - 1))
+                  skip_size = state->file_bytes_left - 1;
+
+               #if defined(FIT_CONVERT_TIME_RECORD)
+                  if (plan->timestamp_size > 0)
+                  {
+                     // The timestamp still has to be tracked for compressed timestamp headers.
+                     FIT_UINT32 start = state->mesg_offset > plan->timestamp_in ? state->mesg_offset : plan->timestamp_in;
+                     FIT_UINT32 end = state->mesg_offset + skip_size < (FIT_UINT32)plan->timestamp_in + plan->timestamp_size ?
+                        state->mesg_offset + skip_size : (FIT_UINT32)plan->timestamp_in + plan->timestamp_size;
+
+                     if (start < end)
+                     {
+                        FIT_UINT16 field_offset = state->convert_table[state->mesg_index].timestamp_offset;
+
+                        memcpy(&state->u.mesg[field_offset + start - plan->timestamp_in], &skip_data[start - state->mesg_offset], end - start);
+                     }
+                  }
+               #endif
+
+               if (state->file_bytes_left > 0)
+               {
+                  #if defined(FIT_CONVERT_CHECK_CRC)
+                     state->crc = FitCRC_Update16(state->crc, skip_data + 1, skip_size - 1);
+                  #endif
+
+                  state->file_bytes_left -= skip_size - 1;
+               }
+
+               state->data_offset += skip_size - 1;
+               state->mesg_offset += skip_size;
+
+               if (state->mesg_offset >= mesg_size)
+               {
+                  state->decode_state = FIT_CONVERT_DECODE_RECORD;
+
+                  #if defined(FIT_CONVERT_TIME_RECORD)
+                     if (plan->timestamp_size > 0)
+                     {
+                        FIT_UINT8 *timestamp = &state->u.mesg[state->convert_table[state->mesg_index].timestamp_offset];
+
+                        switch (plan->timestamp_type_size)
+                        {
+                           case 2:
+                              FitConvert_Swap16(timestamp, plan->timestamp_size / 2);
+                              break;
+
+                           case 4:
+                              FitConvert_Swap32(timestamp, plan->timestamp_size / 4);
+                              break;
+
+                           default:
+                              break;
+                        }
+
+                        FitConvert_UpdateTimestamp(state);
+                     }
+                  #endif
+               }
+            }
+            break;
+
          default:
             // This shouldn't happen.
             return FIT_CONVERT_ERROR;
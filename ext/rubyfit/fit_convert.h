@@ -55,9 +55,72 @@ typedef enum
    FIT_CONVERT_DECODE_DEV_FIELD_SIZE,
    FIT_CONVERT_DECODE_DEV_FIELD_INDEX,
    FIT_CONVERT_DECODE_FIELD_DATA,
-   FIT_CONVERT_DECODE_DEV_FIELD_DATA
+   FIT_CONVERT_DECODE_DEV_FIELD_DATA,
+   FIT_CONVERT_DECODE_SKIP_DATA
 } FIT_CONVERT_DECODE_STATE;
 
+#define FIT_CONVERT_MAX_FIELDS   (sizeof(((FIT_MESG_CONVERT *) FIT_NULL)->fields) / sizeof(FIT_FIELD_CONVERT)) // Maximum number of converted fields per local message.
+#define FIT_CONVERT_FIELD_FILTERS   8 // Maximum number of messages that can have a field filter.
+#define FIT_CONVERT_DEF_HDR_SIZE    4 // Architecture, global message number and number of fields.
+
+typedef struct
+{
+   FIT_UINT16 offset_in; // Offset of the run in the incoming message.
+   FIT_UINT16 offset_local; // Offset of the run in the local message.
+   FIT_UINT16 size;
+} FIT_CONVERT_RUN;
+
+typedef struct
+{
+   FIT_UINT16 offset_local;
+   FIT_UINT16 count; // Number of elements.  Adjacent fields of the same element size share one swap.
+   FIT_UINT8 type_size; // Element size in bytes.
+} FIT_CONVERT_SWAP;
+
+typedef struct
+{
+   FIT_UINT16 offset_local;
+   FIT_UINT8 size;
+} FIT_CONVERT_STRING;
+
+typedef struct
+{
+   FIT_UINT16 offset_local;
+   FIT_UINT16 size;
+} FIT_CONVERT_FILL;
+
+typedef struct
+{
+   FIT_UINT16 global_mesg_num;
+   FIT_UINT8 fields[256 / 8]; // Bit per wanted field number.
+} FIT_CONVERT_FIELD_FILTER;
+
+// Decode plan compiled from a definition message.  Data messages are
+// initialized with the fills, copied with the runs, then fixed up with the
+// swaps and strings.
+typedef struct
+{
+   const FIT_MESG_DEF *mesg_def; // Resolved when the definition was read.
+   FIT_UINT8 num_fills;
+   FIT_UINT8 num_runs;
+   FIT_UINT8 num_swaps;
+   FIT_UINT8 num_strings;
+   FIT_BOOL invalid; // Definition contains a base type that cannot be converted.
+   FIT_BOOL skip; // Data messages are filtered out and only checked for CRC.
+   FIT_BOOL clear_timestamp; // Timestamp is filtered out and only converted to track compressed timestamps.
+   FIT_BOOL return_empty; // Messages are returned even when the field filter left no runs.
+   #if defined(FIT_CONVERT_TIME_RECORD)
+      FIT_UINT16 timestamp_in; // Offset of the timestamp in the incoming message, read when skipping.
+      FIT_UINT8 timestamp_size; // 0 if the incoming message has no timestamp.
+      FIT_UINT8 timestamp_type_size; // Element size to swap the timestamp with, 0 if not swapped.
+   #endif
+   FIT_CONVERT_FILL fills[FIT_CONVERT_MAX_FIELDS + 1]; // Local bytes not written by any run.
+   FIT_CONVERT_RUN runs[FIT_CONVERT_MAX_FIELDS];
+   FIT_CONVERT_SWAP swaps[FIT_CONVERT_MAX_FIELDS];
+   FIT_CONVERT_STRING strings[FIT_CONVERT_MAX_FIELDS];
+   FIT_UINT8 invalids[FIT_MESG_SIZE]; // Local message prototype filled with invalid values.
+} FIT_CONVERT_PLAN;
+
 typedef struct
 {
    FIT_UINT32 file_bytes_left;
@@ -71,6 +134,13 @@ typedef struct
       FIT_UINT8 mesg[FIT_MESG_SIZE];
    }u;
    FIT_MESG_CONVERT convert_table[FIT_LOCAL_MESGS];
+   FIT_CONVERT_PLAN plans[FIT_LOCAL_MESGS];
+   FIT_UINT8 def_bytes[FIT_CONVERT_DEF_HDR_SIZE + FIT_FIELD_DEF_SIZE * 255]; // Definition being read, as far as it affects conversion.
+   FIT_UINT8 mesg_filter[(FIT_MESG_NUM_DEFS + 7) / 8]; // Bit per wanted global message number.
+   FIT_BOOL filter_mesgs;
+   FIT_CONVERT_FIELD_FILTER field_filters[FIT_CONVERT_FIELD_FILTERS];
+   FIT_UINT8 num_field_filters;
+   FIT_UINT8 field_filter; // Index of the field filter of the definition being read, FIT_UINT8_INVALID if none.
    const FIT_MESG_DEF *mesg_def;
    #if defined(FIT_CONVERT_CHECK_CRC)
       FIT_UINT16 crc;
@@ -78,11 +148,11 @@ typedef struct
    FIT_CONVERT_DECODE_STATE decode_state;
    FIT_BOOL has_dev_data;
    FIT_UINT8 mesg_index;
+   FIT_UINT16 defined_mesgs; // Bit per local message that has had a definition.
    FIT_UINT16 mesg_sizes[FIT_MAX_LOCAL_MESGS];
    FIT_UINT8 dev_data_sizes[FIT_MAX_LOCAL_MESGS];
    FIT_UINT16 mesg_offset;
    FIT_UINT8 num_fields;
-   FIT_UINT8 field_num;
    FIT_UINT8 field_index;
    FIT_UINT8 field_offset;
    #if defined(FIT_CONVERT_TIME_RECORD)
@@ -108,6 +178,40 @@ typedef struct
    void FitConvert_Init(FIT_BOOL read_file_header);
 #endif
 
+///////////////////////////////////////////////////////////////////////
+// Restricts conversion to a set of global message numbers.  Data
+// messages of any other type are skipped without being converted; only
+// their CRC is computed.  Call after FitConvert_Init().
+// Parameters:
+//    state         Pointer to converter state.
+//    mesg_nums     Global message numbers to convert, or FIT_NULL to
+//                  convert all messages.
+//    num_mesgs     Number of entries in mesg_nums.
+///////////////////////////////////////////////////////////////////////
+#if defined(FIT_CONVERT_MULTI_THREAD)
+   void FitConvert_SetMessageFilter(FIT_CONVERT_STATE *state, const FIT_UINT16 *mesg_nums, FIT_UINT16 num_mesgs);
+#else
+   void FitConvert_SetMessageFilter(const FIT_UINT16 *mesg_nums, FIT_UINT16 num_mesgs);
+#endif
+
+///////////////////////////////////////////////////////////////////////
+// Restricts the fields converted for a global message number.  Other
+// fields of the message are left invalid.  Call after FitConvert_Init().
+// Parameters:
+//    state             Pointer to converter state.
+//    global_mesg_num   Global message number the filter applies to.
+//    field_nums        Field numbers to convert.
+//    num_fields        Number of entries in field_nums.
+//
+// Returns FIT_FALSE if FIT_CONVERT_FIELD_FILTERS messages already have
+// a filter.
+///////////////////////////////////////////////////////////////////////
+#if defined(FIT_CONVERT_MULTI_THREAD)
+   FIT_BOOL FitConvert_SetFieldFilter(FIT_CONVERT_STATE *state, FIT_UINT16 global_mesg_num, const FIT_UINT8 *field_nums, FIT_UINT8 num_fields);
+#else
+   FIT_BOOL FitConvert_SetFieldFilter(FIT_UINT16 global_mesg_num, const FIT_UINT8 *field_nums, FIT_UINT8 num_fields);
+#endif
+
 ///////////////////////////////////////////////////////////////////////
 // Convert a stream of bytes.
 // Parameters:
@@ -1497,6 +1497,76 @@ const FIT_CONST_MESG_DEF_PTR fit_mesg_defs[] =
    (FIT_CONST_MESG_DEF_PTR) &developer_data_id_mesg_def,
 };
 
+// Indexed by global message number.  Entries without a definition are FIT_NULL.
+const FIT_CONST_MESG_DEF_PTR fit_mesg_defs_by_num[FIT_MESG_NUM_DEFS] =
+{
+   [FIT_MESG_NUM_FILE_ID] = (FIT_CONST_MESG_DEF_PTR) &file_id_mesg_def,
+   [FIT_MESG_NUM_CAPABILITIES] = (FIT_CONST_MESG_DEF_PTR) &capabilities_mesg_def,
+   [FIT_MESG_NUM_DEVICE_SETTINGS] = (FIT_CONST_MESG_DEF_PTR) &device_settings_mesg_def,
+   [FIT_MESG_NUM_USER_PROFILE] = (FIT_CONST_MESG_DEF_PTR) &user_profile_mesg_def,
+   [FIT_MESG_NUM_HRM_PROFILE] = (FIT_CONST_MESG_DEF_PTR) &hrm_profile_mesg_def,
+   [FIT_MESG_NUM_SDM_PROFILE] = (FIT_CONST_MESG_DEF_PTR) &sdm_profile_mesg_def,
+   [FIT_MESG_NUM_BIKE_PROFILE] = (FIT_CONST_MESG_DEF_PTR) &bike_profile_mesg_def,
+   [FIT_MESG_NUM_ZONES_TARGET] = (FIT_CONST_MESG_DEF_PTR) &zones_target_mesg_def,
+   [FIT_MESG_NUM_HR_ZONE] = (FIT_CONST_MESG_DEF_PTR) &hr_zone_mesg_def,
+   [FIT_MESG_NUM_POWER_ZONE] = (FIT_CONST_MESG_DEF_PTR) &power_zone_mesg_def,
+   [FIT_MESG_NUM_MET_ZONE] = (FIT_CONST_MESG_DEF_PTR) &met_zone_mesg_def,
+   [FIT_MESG_NUM_SPORT] = (FIT_CONST_MESG_DEF_PTR) &sport_mesg_def,
+   [FIT_MESG_NUM_GOAL] = (FIT_CONST_MESG_DEF_PTR) &goal_mesg_def,
+   [FIT_MESG_NUM_SESSION] = (FIT_CONST_MESG_DEF_PTR) &session_mesg_def,
+   [FIT_MESG_NUM_LAP] = (FIT_CONST_MESG_DEF_PTR) &lap_mesg_def,
+   [FIT_MESG_NUM_RECORD] = (FIT_CONST_MESG_DEF_PTR) &record_mesg_def,
+   [FIT_MESG_NUM_EVENT] = (FIT_CONST_MESG_DEF_PTR) &event_mesg_def,
+   [FIT_MESG_NUM_DEVICE_INFO] = (FIT_CONST_MESG_DEF_PTR) &device_info_mesg_def,
+   [FIT_MESG_NUM_WORKOUT] = (FIT_CONST_MESG_DEF_PTR) &workout_mesg_def,
+   [FIT_MESG_NUM_WORKOUT_STEP] = (FIT_CONST_MESG_DEF_PTR) &workout_step_mesg_def,
+   [FIT_MESG_NUM_SCHEDULE] = (FIT_CONST_MESG_DEF_PTR) &schedule_mesg_def,
+   [FIT_MESG_NUM_WEIGHT_SCALE] = (FIT_CONST_MESG_DEF_PTR) &weight_scale_mesg_def,
+   [FIT_MESG_NUM_COURSE] = (FIT_CONST_MESG_DEF_PTR) &course_mesg_def,
+   [FIT_MESG_NUM_COURSE_POINT] = (FIT_CONST_MESG_DEF_PTR) &course_point_mesg_def,
+   [FIT_MESG_NUM_TOTALS] = (FIT_CONST_MESG_DEF_PTR) &totals_mesg_def,
+   [FIT_MESG_NUM_ACTIVITY] = (FIT_CONST_MESG_DEF_PTR) &activity_mesg_def,
+   [FIT_MESG_NUM_SOFTWARE] = (FIT_CONST_MESG_DEF_PTR) &software_mesg_def,
+   [FIT_MESG_NUM_FILE_CAPABILITIES] = (FIT_CONST_MESG_DEF_PTR) &file_capabilities_mesg_def,
+   [FIT_MESG_NUM_MESG_CAPABILITIES] = (FIT_CONST_MESG_DEF_PTR) &mesg_capabilities_mesg_def,
+   [FIT_MESG_NUM_FIELD_CAPABILITIES] = (FIT_CONST_MESG_DEF_PTR) &field_capabilities_mesg_def,
+   [FIT_MESG_NUM_FILE_CREATOR] = (FIT_CONST_MESG_DEF_PTR) &file_creator_mesg_def,
+   [FIT_MESG_NUM_BLOOD_PRESSURE] = (FIT_CONST_MESG_DEF_PTR) &blood_pressure_mesg_def,
+   [FIT_MESG_NUM_SPEED_ZONE] = (FIT_CONST_MESG_DEF_PTR) &speed_zone_mesg_def,
+   [FIT_MESG_NUM_MONITORING] = (FIT_CONST_MESG_DEF_PTR) &monitoring_mesg_def,
+   [FIT_MESG_NUM_TRAINING_FILE] = (FIT_CONST_MESG_DEF_PTR) &training_file_mesg_def,
+   [FIT_MESG_NUM_HRV] = (FIT_CONST_MESG_DEF_PTR) &hrv_mesg_def,
+   [FIT_MESG_NUM_ANT_RX] = (FIT_CONST_MESG_DEF_PTR) &ant_rx_mesg_def,
+   [FIT_MESG_NUM_ANT_TX] = (FIT_CONST_MESG_DEF_PTR) &ant_tx_mesg_def,
+   [FIT_MESG_NUM_LENGTH] = (FIT_CONST_MESG_DEF_PTR) &length_mesg_def,
+   [FIT_MESG_NUM_MONITORING_INFO] = (FIT_CONST_MESG_DEF_PTR) &monitoring_info_mesg_def,
+   [FIT_MESG_NUM_PAD] = (FIT_CONST_MESG_DEF_PTR) &pad_mesg_def,
+   [FIT_MESG_NUM_SLAVE_DEVICE] = (FIT_CONST_MESG_DEF_PTR) &slave_device_mesg_def,
+   [FIT_MESG_NUM_CONNECTIVITY] = (FIT_CONST_MESG_DEF_PTR) &connectivity_mesg_def,
+   [FIT_MESG_NUM_WEATHER_CONDITIONS] = (FIT_CONST_MESG_DEF_PTR) &weather_conditions_mesg_def,
+   [FIT_MESG_NUM_WEATHER_ALERT] = (FIT_CONST_MESG_DEF_PTR) &weather_alert_mesg_def,
+   [FIT_MESG_NUM_CADENCE_ZONE] = (FIT_CONST_MESG_DEF_PTR) &cadence_zone_mesg_def,
+   [FIT_MESG_NUM_HR] = (FIT_CONST_MESG_DEF_PTR) &hr_mesg_def,
+   [FIT_MESG_NUM_SEGMENT_LAP] = (FIT_CONST_MESG_DEF_PTR) &segment_lap_mesg_def,
+   [FIT_MESG_NUM_SEGMENT_ID] = (FIT_CONST_MESG_DEF_PTR) &segment_id_mesg_def,
+   [FIT_MESG_NUM_SEGMENT_LEADERBOARD_ENTRY] = (FIT_CONST_MESG_DEF_PTR) &segment_leaderboard_entry_mesg_def,
+   [FIT_MESG_NUM_SEGMENT_POINT] = (FIT_CONST_MESG_DEF_PTR) &segment_point_mesg_def,
+   [FIT_MESG_NUM_SEGMENT_FILE] = (FIT_CONST_MESG_DEF_PTR) &segment_file_mesg_def,
+   [FIT_MESG_NUM_WORKOUT_SESSION] = (FIT_CONST_MESG_DEF_PTR) &workout_session_mesg_def,
+   [FIT_MESG_NUM_NMEA_SENTENCE] = (FIT_CONST_MESG_DEF_PTR) &nmea_sentence_mesg_def,
+   [FIT_MESG_NUM_AVIATION_ATTITUDE] = (FIT_CONST_MESG_DEF_PTR) &aviation_attitude_mesg_def,
+   [FIT_MESG_NUM_VIDEO_TITLE] = (FIT_CONST_MESG_DEF_PTR) &video_title_mesg_def,
+   [FIT_MESG_NUM_VIDEO_DESCRIPTION] = (FIT_CONST_MESG_DEF_PTR) &video_description_mesg_def,
+   [FIT_MESG_NUM_EXD_SCREEN_CONFIGURATION] = (FIT_CONST_MESG_DEF_PTR) &exd_screen_configuration_mesg_def,
+   [FIT_MESG_NUM_EXD_DATA_FIELD_CONFIGURATION] = (FIT_CONST_MESG_DEF_PTR) &exd_data_field_configuration_mesg_def,
+   [FIT_MESG_NUM_EXD_DATA_CONCEPT_CONFIGURATION] = (FIT_CONST_MESG_DEF_PTR) &exd_data_concept_configuration_mesg_def,
+   [FIT_MESG_NUM_FIELD_DESCRIPTION] = (FIT_CONST_MESG_DEF_PTR) &field_description_mesg_def,
+   [FIT_MESG_NUM_DEVELOPER_DATA_ID] = (FIT_CONST_MESG_DEF_PTR) &developer_data_id_mesg_def,
+   [FIT_MESG_NUM_SET] = (FIT_CONST_MESG_DEF_PTR) &set_mesg_def,
+   [FIT_MESG_NUM_DIVE_SETTINGS] = (FIT_CONST_MESG_DEF_PTR) &dive_settings_mesg_def,
+   [FIT_MESG_NUM_EXERCISE_TITLE] = (FIT_CONST_MESG_DEF_PTR) &exercise_title_mesg_def,
+};
+
 ///////////////////////////////////////////////////////////////////////
 // Files
 ///////////////////////////////////////////////////////////////////////
@@ -3830,6 +3830,7 @@ typedef struct
    FIT_UINT8 arch;
    FIT_MESG_NUM global_mesg_num;
    FIT_UINT8 num_fields;
+   FIT_UINT16 timestamp_offset; // Local offset of the timestamp field, FIT_UINT16_INVALID if the message has none.
    FIT_FIELD_CONVERT fields[90];
 } FIT_MESG_CONVERT;
 
@@ -7941,6 +7942,9 @@ typedef enum {
 typedef const FIT_MESG_DEF * FIT_CONST_MESG_DEF_PTR;
 extern const FIT_CONST_MESG_DEF_PTR fit_mesg_defs[FIT_MESGS];
 
+#define FIT_MESG_NUM_DEFS   265 // One past the largest global message number in fit_mesg_defs.
+extern const FIT_CONST_MESG_DEF_PTR fit_mesg_defs_by_num[FIT_MESG_NUM_DEFS];
+
 
 
 
@@ -15,6 +15,20 @@
 #include "stdio.h"
 #include "string.h"
 #include "ruby.h"
+#include "ruby/thread.h"
+#include "ruby/io.h"
+#if defined(HAVE_RUBY_IO_BUFFER_H)
+#include "ruby/io/buffer.h"
+#endif
+#include <fcntl.h>
+#if defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "math.h"
 
 #include "fit_convert.h"
@@ -28,532 +42,2560 @@
  */
 const long GARMIN_TIME_OFFSET = 631065600;
 
+/*
+ * Fields passed to the handler for each message, by hash key.
+ */
+struct field_name {
+	const char *name;
+	FIT_UINT8 field_num;
+};
+
+static const struct field_name activity_fields[] = {
+	{ "timestamp", FIT_ACTIVITY_FIELD_NUM_TIMESTAMP },
+	{ "total_timer_time", FIT_ACTIVITY_FIELD_NUM_TOTAL_TIMER_TIME },
+	{ "local_timestamp", FIT_ACTIVITY_FIELD_NUM_LOCAL_TIMESTAMP },
+	{ "num_sessions", FIT_ACTIVITY_FIELD_NUM_NUM_SESSIONS },
+	{ "type", FIT_ACTIVITY_FIELD_NUM_TYPE },
+	{ "event", FIT_ACTIVITY_FIELD_NUM_EVENT },
+	{ "event_type", FIT_ACTIVITY_FIELD_NUM_EVENT_TYPE },
+	{ "event_group", FIT_ACTIVITY_FIELD_NUM_EVENT_GROUP }
+};
+
+static const struct field_name device_info_fields[] = {
+	{ "timestamp", FIT_DEVICE_INFO_FIELD_NUM_TIMESTAMP },
+	{ "serial_number", FIT_DEVICE_INFO_FIELD_NUM_SERIAL_NUMBER },
+	{ "manufacturer", FIT_DEVICE_INFO_FIELD_NUM_MANUFACTURER },
+	{ "product", FIT_DEVICE_INFO_FIELD_NUM_PRODUCT },
+	{ "software_version", FIT_DEVICE_INFO_FIELD_NUM_SOFTWARE_VERSION },
+	{ "battery_voltage", FIT_DEVICE_INFO_FIELD_NUM_BATTERY_VOLTAGE },
+	{ "device_index", FIT_DEVICE_INFO_FIELD_NUM_DEVICE_INDEX },
+	{ "device_type", FIT_DEVICE_INFO_FIELD_NUM_DEVICE_TYPE },
+	{ "hardware_version", FIT_DEVICE_INFO_FIELD_NUM_HARDWARE_VERSION },
+	{ "battery_status", FIT_DEVICE_INFO_FIELD_NUM_BATTERY_STATUS }
+};
+
+static const struct field_name event_fields[] = {
+	{ "timestamp", FIT_EVENT_FIELD_NUM_TIMESTAMP },
+	{ "data", FIT_EVENT_FIELD_NUM_DATA },
+	{ "data16", FIT_EVENT_FIELD_NUM_DATA16 },
+	{ "event", FIT_EVENT_FIELD_NUM_EVENT },
+	{ "event_type", FIT_EVENT_FIELD_NUM_EVENT_TYPE },
+	{ "event_group", FIT_EVENT_FIELD_NUM_EVENT_GROUP }
+};
+
+static const struct field_name lap_fields[] = {
+	{ "timestamp", FIT_LAP_FIELD_NUM_TIMESTAMP },
+	{ "start_time", FIT_LAP_FIELD_NUM_START_TIME },
+	{ "start_position_lat", FIT_LAP_FIELD_NUM_START_POSITION_LAT },
+	{ "start_position_long", FIT_LAP_FIELD_NUM_START_POSITION_LONG },
+	{ "end_position_lat", FIT_LAP_FIELD_NUM_END_POSITION_LAT },
+	{ "end_position_long", FIT_LAP_FIELD_NUM_END_POSITION_LONG },
+	{ "total_elapsed_time", FIT_LAP_FIELD_NUM_TOTAL_ELAPSED_TIME },
+	{ "total_timer_time", FIT_LAP_FIELD_NUM_TOTAL_TIMER_TIME },
+	{ "total_distance", FIT_LAP_FIELD_NUM_TOTAL_DISTANCE },
+	{ "total_cycles", FIT_LAP_FIELD_NUM_TOTAL_CYCLES },
+	{ "message_index", FIT_LAP_FIELD_NUM_MESSAGE_INDEX },
+	{ "total_calories", FIT_LAP_FIELD_NUM_TOTAL_CALORIES },
+	{ "total_fat_calories", FIT_LAP_FIELD_NUM_TOTAL_FAT_CALORIES },
+	{ "avg_speed", FIT_LAP_FIELD_NUM_AVG_SPEED },
+	{ "max_speed", FIT_LAP_FIELD_NUM_MAX_SPEED },
+	{ "enhanced_avg_speed", FIT_LAP_FIELD_NUM_ENHANCED_AVG_SPEED },
+	{ "enhanced_max_speed", FIT_LAP_FIELD_NUM_ENHANCED_MAX_SPEED },
+	{ "avg_altitude", FIT_LAP_FIELD_NUM_AVG_ALTITUDE },
+	{ "max_altitude", FIT_LAP_FIELD_NUM_MAX_ALTITUDE },
+	{ "min_altitude", FIT_LAP_FIELD_NUM_MIN_ALTITUDE },
+	{ "enhanced_avg_altitude", FIT_LAP_FIELD_NUM_ENHANCED_AVG_ALTITUDE },
+	{ "enhanced_max_altitude", FIT_LAP_FIELD_NUM_ENHANCED_MAX_ALTITUDE },
+	{ "enhanced_min_altitude", FIT_LAP_FIELD_NUM_ENHANCED_MIN_ALTITUDE },
+	{ "avg_power", FIT_LAP_FIELD_NUM_AVG_POWER },
+	{ "max_power", FIT_LAP_FIELD_NUM_MAX_POWER },
+	{ "total_ascent", FIT_LAP_FIELD_NUM_TOTAL_ASCENT },
+	{ "total_descent", FIT_LAP_FIELD_NUM_TOTAL_DESCENT },
+	{ "event", FIT_LAP_FIELD_NUM_EVENT },
+	{ "event_type", FIT_LAP_FIELD_NUM_EVENT_TYPE },
+	{ "avg_heart_rate", FIT_LAP_FIELD_NUM_AVG_HEART_RATE },
+	{ "max_heart_rate", FIT_LAP_FIELD_NUM_MAX_HEART_RATE },
+	{ "avg_cadence", FIT_LAP_FIELD_NUM_AVG_CADENCE },
+	{ "max_cadence", FIT_LAP_FIELD_NUM_MAX_CADENCE },
+	{ "intensity", FIT_LAP_FIELD_NUM_INTENSITY },
+	{ "lap_trigger", FIT_LAP_FIELD_NUM_LAP_TRIGGER },
+	{ "sport", FIT_LAP_FIELD_NUM_SPORT },
+	{ "event_group", FIT_LAP_FIELD_NUM_EVENT_GROUP }
+};
+
+static const struct field_name record_fields[] = {
+	{ "timestamp", FIT_RECORD_FIELD_NUM_TIMESTAMP },
+	{ "position_lat", FIT_RECORD_FIELD_NUM_POSITION_LAT },
+	{ "position_long", FIT_RECORD_FIELD_NUM_POSITION_LONG },
+	{ "distance", FIT_RECORD_FIELD_NUM_DISTANCE },
+	{ "time_from_course", FIT_RECORD_FIELD_NUM_TIME_FROM_COURSE },
+	{ "heart_rate", FIT_RECORD_FIELD_NUM_HEART_RATE },
+	{ "altitude", FIT_RECORD_FIELD_NUM_ALTITUDE },
+	{ "enhanced_altitude", FIT_RECORD_FIELD_NUM_ENHANCED_ALTITUDE },
+	{ "speed", FIT_RECORD_FIELD_NUM_SPEED },
+	{ "enhanced_speed", FIT_RECORD_FIELD_NUM_ENHANCED_SPEED },
+	{ "grade", FIT_RECORD_FIELD_NUM_GRADE },
+	{ "power", FIT_RECORD_FIELD_NUM_POWER },
+	{ "cadence", FIT_RECORD_FIELD_NUM_CADENCE },
+	{ "resistance", FIT_RECORD_FIELD_NUM_RESISTANCE },
+	{ "cycle_length", FIT_RECORD_FIELD_NUM_CYCLE_LENGTH },
+	{ "temperature", FIT_RECORD_FIELD_NUM_TEMPERATURE },
+	{ "left_right_balance", FIT_RECORD_FIELD_NUM_LEFT_RIGHT_BALANCE },
+	{ "left_torque_effectiveness", FIT_RECORD_FIELD_NUM_LEFT_TORQUE_EFFECTIVENESS },
+	{ "right_torque_effectiveness", FIT_RECORD_FIELD_NUM_RIGHT_TORQUE_EFFECTIVENESS },
+	{ "left_pedal_smoothness", FIT_RECORD_FIELD_NUM_LEFT_PEDAL_SMOOTHNESS },
+	{ "right_pedal_smoothness", FIT_RECORD_FIELD_NUM_RIGHT_PEDAL_SMOOTHNESS },
+	{ "combined_pedal_smoothness", FIT_RECORD_FIELD_NUM_COMBINED_PEDAL_SMOOTHNESS }
+};
+
+static const struct field_name session_fields[] = {
+	{ "timestamp", FIT_SESSION_FIELD_NUM_TIMESTAMP },
+	{ "start_time", FIT_SESSION_FIELD_NUM_START_TIME },
+	{ "start_position_lat", FIT_SESSION_FIELD_NUM_START_POSITION_LAT },
+	{ "start_position_long", FIT_SESSION_FIELD_NUM_START_POSITION_LONG },
+	{ "total_elapsed_time", FIT_SESSION_FIELD_NUM_TOTAL_ELAPSED_TIME },
+	{ "total_timer_time", FIT_SESSION_FIELD_NUM_TOTAL_TIMER_TIME },
+	{ "total_distance", FIT_SESSION_FIELD_NUM_TOTAL_DISTANCE },
+	{ "total_cycles", FIT_SESSION_FIELD_NUM_TOTAL_CYCLES },
+	{ "nec_lat", FIT_SESSION_FIELD_NUM_NEC_LAT },
+	{ "nec_long", FIT_SESSION_FIELD_NUM_NEC_LONG },
+	{ "swc_lat", FIT_SESSION_FIELD_NUM_SWC_LAT },
+	{ "swc_long", FIT_SESSION_FIELD_NUM_SWC_LONG },
+	{ "message_index", FIT_SESSION_FIELD_NUM_MESSAGE_INDEX },
+	{ "total_calories", FIT_SESSION_FIELD_NUM_TOTAL_CALORIES },
+	{ "total_fat_calories", FIT_SESSION_FIELD_NUM_TOTAL_FAT_CALORIES },
+	{ "avg_speed", FIT_SESSION_FIELD_NUM_AVG_SPEED },
+	{ "max_speed", FIT_SESSION_FIELD_NUM_MAX_SPEED },
+	{ "avg_power", FIT_SESSION_FIELD_NUM_AVG_POWER },
+	{ "max_power", FIT_SESSION_FIELD_NUM_MAX_POWER },
+	{ "total_ascent", FIT_SESSION_FIELD_NUM_TOTAL_ASCENT },
+	{ "total_descent", FIT_SESSION_FIELD_NUM_TOTAL_DESCENT },
+	{ "first_lap_index", FIT_SESSION_FIELD_NUM_FIRST_LAP_INDEX },
+	{ "num_laps", FIT_SESSION_FIELD_NUM_NUM_LAPS },
+	{ "event", FIT_SESSION_FIELD_NUM_EVENT },
+	{ "event_type", FIT_SESSION_FIELD_NUM_EVENT_TYPE },
+	{ "avg_heart_rate", FIT_SESSION_FIELD_NUM_AVG_HEART_RATE },
+	{ "max_heart_rate", FIT_SESSION_FIELD_NUM_MAX_HEART_RATE },
+	{ "avg_cadence", FIT_SESSION_FIELD_NUM_AVG_CADENCE },
+	{ "max_cadence", FIT_SESSION_FIELD_NUM_MAX_CADENCE },
+	{ "sport", FIT_SESSION_FIELD_NUM_SPORT },
+	{ "sub_sport", FIT_SESSION_FIELD_NUM_SUB_SPORT },
+	{ "event_group", FIT_SESSION_FIELD_NUM_EVENT_GROUP },
+	{ "total_training_effect", FIT_SESSION_FIELD_NUM_TOTAL_TRAINING_EFFECT }
+};
+
+static const struct field_name user_profile_fields[] = {
+	{ "friendly_name", FIT_USER_PROFILE_FIELD_NUM_FRIENDLY_NAME },
+	{ "message_index", FIT_USER_PROFILE_FIELD_NUM_MESSAGE_INDEX },
+	{ "weight", FIT_USER_PROFILE_FIELD_NUM_WEIGHT },
+	{ "gender", FIT_USER_PROFILE_FIELD_NUM_GENDER },
+	{ "age", FIT_USER_PROFILE_FIELD_NUM_AGE },
+	{ "height", FIT_USER_PROFILE_FIELD_NUM_HEIGHT },
+	{ "language", FIT_USER_PROFILE_FIELD_NUM_LANGUAGE },
+	{ "elev_setting", FIT_USER_PROFILE_FIELD_NUM_ELEV_SETTING },
+	{ "weight_setting", FIT_USER_PROFILE_FIELD_NUM_WEIGHT_SETTING },
+	{ "resting_heart_rate", FIT_USER_PROFILE_FIELD_NUM_RESTING_HEART_RATE },
+	{ "default_max_running_heart_rate", FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_RUNNING_HEART_RATE },
+	{ "default_max_biking_heart_rate", FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_BIKING_HEART_RATE },
+	{ "default_max_heart_rate", FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_HEART_RATE },
+	{ "hr_setting", FIT_USER_PROFILE_FIELD_NUM_HR_SETTING },
+	{ "speed_setting", FIT_USER_PROFILE_FIELD_NUM_SPEED_SETTING },
+	{ "dist_setting", FIT_USER_PROFILE_FIELD_NUM_DIST_SETTING },
+	{ "power_setting", FIT_USER_PROFILE_FIELD_NUM_POWER_SETTING },
+	{ "activity_class", FIT_USER_PROFILE_FIELD_NUM_ACTIVITY_CLASS },
+	{ "position_setting", FIT_USER_PROFILE_FIELD_NUM_POSITION_SETTING }
+};
+
+static const struct field_name weight_scale_fields[] = {
+	{ "timestamp", FIT_WEIGHT_SCALE_FIELD_NUM_TIMESTAMP },
+	{ "weight", FIT_WEIGHT_SCALE_FIELD_NUM_WEIGHT },
+	{ "percent_fat", FIT_WEIGHT_SCALE_FIELD_NUM_PERCENT_FAT },
+	{ "percent_hydration", FIT_WEIGHT_SCALE_FIELD_NUM_PERCENT_HYDRATION },
+	{ "visceral_fat_mass", FIT_WEIGHT_SCALE_FIELD_NUM_VISCERAL_FAT_MASS },
+	{ "bone_mass", FIT_WEIGHT_SCALE_FIELD_NUM_BONE_MASS },
+	{ "muscle_mass", FIT_WEIGHT_SCALE_FIELD_NUM_MUSCLE_MASS },
+	{ "basal_met", FIT_WEIGHT_SCALE_FIELD_NUM_BASAL_MET },
+	{ "active_met", FIT_WEIGHT_SCALE_FIELD_NUM_ACTIVE_MET },
+	{ "physique_rating", FIT_WEIGHT_SCALE_FIELD_NUM_PHYSIQUE_RATING },
+	{ "metabolic_age", FIT_WEIGHT_SCALE_FIELD_NUM_METABOLIC_AGE },
+	{ "visceral_fat_rating", FIT_WEIGHT_SCALE_FIELD_NUM_VISCERAL_FAT_RATING }
+};
+
+#define FIELD_NAMES(fields) fields, sizeof(fields) / sizeof(fields[0])
+
+enum {
+	MESSAGE_ACTIVITY,
+	MESSAGE_DEVICE_INFO,
+	MESSAGE_EVENT,
+	MESSAGE_LAP,
+	MESSAGE_RECORD,
+	MESSAGE_SESSION,
+	MESSAGE_USER_PROFILE,
+	MESSAGE_WEIGHT_SCALE,
+	MESSAGES
+};
+
+/*
+ * Messages that can be passed in the messages: and fields: options of
+ * FitParser.new, by the name of the message in the FIT profile.
+ */
+static const struct {
+	const char *name;
+	FIT_UINT16 mesg_num;
+	const struct field_name *fields;
+	size_t num_fields;
+	const char *callback;
+	const char *class_name;
+} message_names[MESSAGES] = {
+	[MESSAGE_ACTIVITY] = { "activity", FIT_MESG_NUM_ACTIVITY, FIELD_NAMES(activity_fields), "on_activity", "Activity" },
+	[MESSAGE_DEVICE_INFO] = { "device_info", FIT_MESG_NUM_DEVICE_INFO, FIELD_NAMES(device_info_fields), "on_device_info", "DeviceInfo" },
+	[MESSAGE_EVENT] = { "event", FIT_MESG_NUM_EVENT, FIELD_NAMES(event_fields), "on_event", "Event" },
+	[MESSAGE_LAP] = { "lap", FIT_MESG_NUM_LAP, FIELD_NAMES(lap_fields), "on_lap", "Lap" },
+	[MESSAGE_RECORD] = { "record", FIT_MESG_NUM_RECORD, FIELD_NAMES(record_fields), "on_record", "Record" },
+	[MESSAGE_SESSION] = { "session", FIT_MESG_NUM_SESSION, FIELD_NAMES(session_fields), "on_session", "Session" },
+	[MESSAGE_USER_PROFILE] = { "user_profile", FIT_MESG_NUM_USER_PROFILE, FIELD_NAMES(user_profile_fields), "on_user_profile", "UserProfile" },
+	[MESSAGE_WEIGHT_SCALE] = { "weight_scale", FIT_MESG_NUM_WEIGHT_SCALE, FIELD_NAMES(weight_scale_fields), "on_weight_scale_info", "WeightScale" }
+};
+
+/*
+ * Hash keys for each message, by field number.  They are created once in
+ * Init_rubyfit so that building a message hash never allocates a key:
+ * KEYS_STRING holds frozen interned strings, KEYS_SYMBOL the symbols used
+ * when FitParser.new is given symbolize_keys: true.
+ */
+#define KEYS_STRING 0
+#define KEYS_SYMBOL 1
+
+static VALUE message_keys[2][MESSAGES][256];
+
+/*
+ * Struct classes passed for structs: true (RubyFit::Record, ...), with the
+ * member index of each field by field number.  Members are in the order of
+ * the field names above.
+ */
+static VALUE message_classes[MESSAGES];
+static FIT_UINT8 message_members[MESSAGES][256];
+
+/*
+ * Handler methods, interned once in Init_rubyfit.
+ */
+static ID message_callbacks[MESSAGES];
+static ID id_on_records;
+static ID id_print_msg;
+static ID id_print_error_msg;
+
+/*
+ * Records passed to on_records at a time for batch_records: true.
+ */
+#define DEFAULT_BATCH_RECORDS 1024
+
+/*
+ * Message hashes are sized up front for every field the message can hold.
+ */
+#if defined(HAVE_RB_HASH_NEW_CAPA)
+#define message_hash_new(message) rb_hash_new_capa(message_names[message].num_fields)
+#else
+#define message_hash_new(message) rb_hash_new()
+#endif
+
+
+void pass_message(VALUE handler, const char *msg) {
+	if(rb_respond_to(handler, id_print_msg))
+		rb_funcall(handler, id_print_msg, 1, rb_str_new2(msg));
+}
+
+void pass_err_message(VALUE handler, const char *msg) {
+	if(rb_respond_to(handler, id_print_error_msg))
+		rb_funcall(handler, id_print_error_msg, 1, rb_str_new2(msg));
+}
+
+/*
+ * Bit set of the messages the handler has a callback for.  Messages without
+ * one are never converted into a hash.
+ */
+static unsigned int handler_callbacks(VALUE handler) {
+	unsigned int callbacks = 0;
+	size_t i;
+
+	for(i = 0; i < MESSAGES; i++) {
+		if(rb_respond_to(handler, message_callbacks[i]))
+			callbacks |= 1U << i;
+	}
+
+	return callbacks;
+}
+
+static float fit_pos_to_degrees(FIT_SINT32 pos) {
+	float tmp = pos * (180.0 / pow(2,31));
+	tmp -= (tmp > 180.0 ? 360.0 : 0.0);
+	return tmp;
+}
+
+/*
+ * How messages are passed to the handler, from the FitParser.new options.
+ */
+struct message_format {
+	VALUE (*keys)[256]; // Hash keys by message and field number, NULL to pass Structs.
+	VALUE *reused; // One object per message type for reuse_messages: true, NULL otherwise.
+	FIT_BOOL lazy; // Pass LazyMessages, converting fields only when they are read.
+};
+
+/*
+ * What a message is converted into: a Hash, a Struct when keys is NULL, or
+ * only the value of one field when field is not MESSAGE_FIELDS_ALL.
+ */
+struct message_target {
+	VALUE object;
+	const VALUE *keys;
+	const FIT_UINT8 *members;
+	int field;
+	VALUE *value;
+};
+
+#define MESSAGE_FIELDS_ALL -1
+
+/*
+ * A decoded message, as laid out by the FIT_*_MESG structs.
+ */
+union message_data {
+	FIT_UINT8 bytes[FIT_MESG_SIZE];
+	FIT_FLOAT64 align;
+};
+
+static const struct message_target *message_target(struct message_target *target, const struct message_format *format, size_t message) {
+	target->keys = format->keys ? format->keys[message] : NULL;
+	target->members = message_members[message];
+	target->field = MESSAGE_FIELDS_ALL;
+	target->value = NULL;
+
+	if(format->reused && !NIL_P(format->reused[message])) {
+		target->object = format->reused[message];
+
+		if(target->keys) {
+			rb_hash_clear(target->object);
+		} else {
+			size_t i;
+
+			for(i = 0; i < message_names[message].num_fields; i++)
+				RSTRUCT_SET(target->object, i, Qnil);
+		}
+	} else {
+		target->object = target->keys ? message_hash_new(message) : rb_struct_alloc_noinit(message_classes[message]);
+
+		if(format->reused)
+			format->reused[message] = target->object;
+	}
+
+	return target;
+}
+
+static int message_wants(const struct message_target *target, FIT_UINT8 field_num) {
+	return target->field == MESSAGE_FIELDS_ALL || target->field == field_num;
+}
+
+static void message_set(const struct message_target *target, FIT_UINT8 field_num, VALUE value) {
+	if(target->field != MESSAGE_FIELDS_ALL)
+		*target->value = value;
+	else if(target->keys)
+		rb_hash_aset(target->object, target->keys[field_num], value);
+	else
+		RSTRUCT_SET(target->object, target->members[field_num], value);
+}
+
+static VALUE fit_pos_to_rb(FIT_SINT32 pos) {
+	return rb_float_new(fit_pos_to_degrees(pos));
+}
+
+
+static size_t message_index(VALUE name) {
+	const char *str;
+	size_t i;
+
+	if(SYMBOL_P(name))
+		name = rb_sym2str(name);
+
+	str = StringValueCStr(name);
+
+	for(i = 0; i < sizeof(message_names) / sizeof(message_names[0]); i++) {
+		if(strcmp(str, message_names[i].name) == 0)
+			return i;
+	}
+
+	rb_raise(rb_eArgError, "unknown message: %s", str);
+	return 0;
+}
+
+static VALUE message_num(VALUE name) {
+	return UINT2NUM(message_names[message_index(name)].mesg_num);
+}
+
+static VALUE field_num(size_t message, VALUE name) {
+	const char *str;
+	size_t i;
+
+	if(SYMBOL_P(name))
+		name = rb_sym2str(name);
+
+	str = StringValueCStr(name);
+
+	for(i = 0; i < message_names[message].num_fields; i++) {
+		if(strcmp(str, message_names[message].fields[i].name) == 0)
+			return UINT2NUM(message_names[message].fields[i].field_num);
+	}
+
+	rb_raise(rb_eArgError, "unknown %s field: %s", message_names[message].name, str);
+	return Qnil;
+}
+
+static int add_field_filter(VALUE message, VALUE fields, VALUE filter) {
+	size_t index = message_index(message);
+	VALUE field_nums = rb_ary_new();
+	long i;
+
+	fields = rb_Array(fields);
+
+	for(i = 0; i < RARRAY_LEN(fields); i++)
+		rb_ary_push(field_nums, field_num(index, RARRAY_AREF(fields, i)));
+
+	rb_hash_aset(filter, UINT2NUM(message_names[index].mesg_num), rb_ary_freeze(field_nums));
+	return ST_CONTINUE;
+}
+
+/*
+ * FitParser.new(handler, messages: nil, fields: nil, symbolize_keys: false,
+ *               batch_records: nil, reuse_messages: false, structs: false,
+ *               lazy: false)
+ *
+ * When messages is given, only those messages (e.g. [:record, :lap]) are
+ * decoded and passed to the handler.  All other messages are skipped by the
+ * decoder without being converted.
+ *
+ * When fields is given, only those fields of a message are decoded and
+ * passed to the handler, e.g. { record: [:timestamp, :position_lat] }.
+ *
+ * When symbolize_keys is true, messages are passed with Symbol keys
+ * (:timestamp) instead of String keys ("timestamp").
+ *
+ * When batch_records is given and the handler has an on_records method,
+ * records are passed to on_records in arrays of up to that many records
+ * (DEFAULT_BATCH_RECORDS for true) instead of one at a time to on_record.
+ * A batch is passed as soon as any other message comes along, so the
+ * handler still sees every message in file order.
+ *
+ * When reuse_messages is true, the same object is passed for every message of
+ * a type, cleared and refilled each time, so the handler must copy out what
+ * it needs before returning.  Batched records always get their own hashes.
+ *
+ * When structs is true, messages are passed as RubyFit::Record,
+ * RubyFit::Lap, ... Structs instead of hashes, with nil for absent fields.
+ *
+ * When lazy is true, messages are passed as RubyFit::LazyMessage::Record,
+ * RubyFit::LazyMessage::Lap, ... which hold the decoded message and only
+ * convert a field when it is read, by name with [] or by its accessor.
+ */
+static VALUE init(int argc, VALUE *argv, VALUE self) {
+	VALUE handler, opts, values[7];
+	VALUE messages = Qnil, fields = Qnil, symbolize_keys = Qfalse, batch_records = Qnil, reuse_messages = Qfalse, structs = Qfalse, lazy = Qfalse;
+
+	rb_scan_args(argc, argv, "1:", &handler, &opts);
+
+	if(!NIL_P(opts)) {
+		ID keywords[7];
+		keywords[0] = rb_intern("messages");
+		keywords[1] = rb_intern("fields");
+		keywords[2] = rb_intern("symbolize_keys");
+		keywords[3] = rb_intern("batch_records");
+		keywords[4] = rb_intern("reuse_messages");
+		keywords[5] = rb_intern("structs");
+		keywords[6] = rb_intern("lazy");
+		rb_get_kwargs(opts, keywords, 0, 7, values);
+
+		if(values[0] != Qundef)
+			messages = values[0];
+		if(values[1] != Qundef)
+			fields = values[1];
+		if(values[2] != Qundef)
+			symbolize_keys = RTEST(values[2]) ? Qtrue : Qfalse;
+		if(values[3] != Qundef)
+			batch_records = values[3];
+		if(values[4] != Qundef)
+			reuse_messages = RTEST(values[4]) ? Qtrue : Qfalse;
+		if(values[5] != Qundef)
+			structs = RTEST(values[5]) ? Qtrue : Qfalse;
+		if(values[6] != Qundef)
+			lazy = RTEST(values[6]) ? Qtrue : Qfalse;
+	}
+
+	if(RTEST(structs) && RTEST(lazy))
+		rb_raise(rb_eArgError, "structs and lazy can't be combined");
+
+	if(batch_records == Qtrue) {
+		batch_records = INT2FIX(DEFAULT_BATCH_RECORDS);
+	} else if(batch_records == Qfalse) {
+		batch_records = Qnil;
+	} else if(!NIL_P(batch_records)) {
+		batch_records = rb_to_int(batch_records);
+
+		if(NUM2LONG(batch_records) < 1)
+			rb_raise(rb_eArgError, "batch_records must be positive");
+	}
+
+	if(!NIL_P(fields)) {
+		VALUE filter = rb_hash_new();
+
+		rb_hash_foreach(rb_convert_type(fields, T_HASH, "Hash", "to_hash"), add_field_filter, filter);
+		fields = rb_hash_freeze(filter);
+	}
+
+	if(!NIL_P(messages)) {
+		VALUE filter = rb_ary_new();
+		long i;
+
+		messages = rb_Array(messages);
+
+		for(i = 0; i < RARRAY_LEN(messages); i++) {
+			VALUE mesg_num = message_num(RARRAY_AREF(messages, i));
+
+			if(!RTEST(rb_ary_includes(filter, mesg_num)))
+				rb_ary_push(filter, mesg_num);
+		}
+
+		messages = rb_ary_freeze(filter);
+	}
+
+	rb_ivar_set(self, rb_intern("@handler"), handler);
+	rb_ivar_set(self, rb_intern("@message_filter"), messages);
+	rb_ivar_set(self, rb_intern("@field_filter"), fields);
+	rb_ivar_set(self, rb_intern("@symbolize_keys"), symbolize_keys);
+	rb_ivar_set(self, rb_intern("@batch_records"), batch_records);
+	rb_ivar_set(self, rb_intern("@reuse_messages"), reuse_messages);
+	rb_ivar_set(self, rb_intern("@structs"), structs);
+	rb_ivar_set(self, rb_intern("@lazy"), lazy);
+
+	return Qnil;
+}
+
+static void fill_activity(const struct message_target *target, const FIT_ACTIVITY_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->total_timer_time != FIT_UINT32_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_TOTAL_TIMER_TIME))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_TOTAL_TIMER_TIME, rb_float_new(mesg->total_timer_time / 1000.0));
+	if(mesg->local_timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_LOCAL_TIMESTAMP))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_LOCAL_TIMESTAMP, rb_float_new(mesg->local_timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->num_sessions != FIT_UINT16_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_NUM_SESSIONS))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_NUM_SESSIONS, UINT2NUM(mesg->num_sessions));
+	if(mesg->type != FIT_ENUM_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_TYPE))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_TYPE, CHR2FIX(mesg->type));
+	if(mesg->event != FIT_ENUM_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_EVENT))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_EVENT, CHR2FIX(mesg->event));
+	if(mesg->event_type != FIT_ENUM_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_EVENT_TYPE))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_EVENT_TYPE, CHR2FIX(mesg->event_type));
+	if(mesg->event_group != FIT_UINT8_INVALID && message_wants(target, FIT_ACTIVITY_FIELD_NUM_EVENT_GROUP))
+		message_set(target, FIT_ACTIVITY_FIELD_NUM_EVENT_GROUP, UINT2NUM(mesg->event_group));
+}
+
+static void fill_record(const struct message_target *target, const FIT_RECORD_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_RECORD_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->position_lat != FIT_SINT32_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_POSITION_LAT))
+		message_set(target, FIT_RECORD_FIELD_NUM_POSITION_LAT, fit_pos_to_rb(mesg->position_lat));
+	if(mesg->position_long != FIT_SINT32_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_POSITION_LONG))
+		message_set(target, FIT_RECORD_FIELD_NUM_POSITION_LONG, fit_pos_to_rb(mesg->position_long));
+	if(mesg->distance != FIT_UINT32_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_DISTANCE))
+		message_set(target, FIT_RECORD_FIELD_NUM_DISTANCE, rb_float_new(mesg->distance / 100.0));
+	if(mesg->time_from_course != FIT_SINT32_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_TIME_FROM_COURSE))
+		message_set(target, FIT_RECORD_FIELD_NUM_TIME_FROM_COURSE, rb_float_new(mesg->time_from_course / 1000.0));
+	if(mesg->heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_HEART_RATE))
+		message_set(target, FIT_RECORD_FIELD_NUM_HEART_RATE, UINT2NUM(mesg->heart_rate));
+	if(mesg->altitude != FIT_UINT16_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_ALTITUDE))
+		message_set(target, FIT_RECORD_FIELD_NUM_ALTITUDE, rb_float_new(mesg->altitude / 5.0 - 500));
+	if(mesg->enhanced_altitude != FIT_UINT32_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_ENHANCED_ALTITUDE))
+		message_set(target, FIT_RECORD_FIELD_NUM_ENHANCED_ALTITUDE, rb_float_new(mesg->enhanced_altitude / 5.0 - 500));
+	if(mesg->speed != FIT_UINT16_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_SPEED))
+		message_set(target, FIT_RECORD_FIELD_NUM_SPEED, rb_float_new(mesg->speed / 1000.0));
+	if(mesg->enhanced_speed != FIT_UINT32_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_ENHANCED_SPEED))
+		message_set(target, FIT_RECORD_FIELD_NUM_ENHANCED_SPEED, rb_float_new(mesg->enhanced_speed / 1000.0));
+	if(mesg->grade != FIT_SINT16_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_GRADE))
+		message_set(target, FIT_RECORD_FIELD_NUM_GRADE, rb_float_new(mesg->grade / 100.0));
+	if(mesg->power != FIT_UINT16_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_POWER))
+		message_set(target, FIT_RECORD_FIELD_NUM_POWER, UINT2NUM(mesg->power));
+	if(mesg->cadence != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_CADENCE))
+		message_set(target, FIT_RECORD_FIELD_NUM_CADENCE, UINT2NUM(mesg->cadence));
+	if(mesg->resistance != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_RESISTANCE))
+		message_set(target, FIT_RECORD_FIELD_NUM_RESISTANCE, UINT2NUM(mesg->resistance));
+	if(mesg->cycle_length != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_CYCLE_LENGTH))
+		message_set(target, FIT_RECORD_FIELD_NUM_CYCLE_LENGTH, UINT2NUM(mesg->cycle_length));
+	if(mesg->temperature != FIT_SINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_TEMPERATURE))
+		message_set(target, FIT_RECORD_FIELD_NUM_TEMPERATURE, INT2FIX(mesg->temperature));
+
+	if(mesg->left_right_balance != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_LEFT_RIGHT_BALANCE))
+		message_set(target, FIT_RECORD_FIELD_NUM_LEFT_RIGHT_BALANCE, UINT2NUM(mesg->left_right_balance & FIT_LEFT_RIGHT_BALANCE_MASK));
+	if(mesg->left_torque_effectiveness != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_LEFT_TORQUE_EFFECTIVENESS))
+		message_set(target, FIT_RECORD_FIELD_NUM_LEFT_TORQUE_EFFECTIVENESS, UINT2NUM(mesg->left_torque_effectiveness));
+	if(mesg->right_torque_effectiveness != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_RIGHT_TORQUE_EFFECTIVENESS))
+		message_set(target, FIT_RECORD_FIELD_NUM_RIGHT_TORQUE_EFFECTIVENESS, UINT2NUM(mesg->right_torque_effectiveness));
+	if(mesg->left_pedal_smoothness != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_LEFT_PEDAL_SMOOTHNESS))
+		message_set(target, FIT_RECORD_FIELD_NUM_LEFT_PEDAL_SMOOTHNESS, UINT2NUM(mesg->left_pedal_smoothness));
+	if(mesg->right_pedal_smoothness != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_RIGHT_PEDAL_SMOOTHNESS))
+		message_set(target, FIT_RECORD_FIELD_NUM_RIGHT_PEDAL_SMOOTHNESS, UINT2NUM(mesg->right_pedal_smoothness));
+	if(mesg->combined_pedal_smoothness != FIT_UINT8_INVALID && message_wants(target, FIT_RECORD_FIELD_NUM_COMBINED_PEDAL_SMOOTHNESS))
+		message_set(target, FIT_RECORD_FIELD_NUM_COMBINED_PEDAL_SMOOTHNESS, UINT2NUM(mesg->combined_pedal_smoothness));
+}
+
+static void fill_lap(const struct message_target *target, const FIT_LAP_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_LAP_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->start_time != FIT_DATE_TIME_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_START_TIME))
+		message_set(target, FIT_LAP_FIELD_NUM_START_TIME, UINT2NUM(mesg->start_time + GARMIN_TIME_OFFSET));
+	if(mesg->start_position_lat != FIT_SINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_START_POSITION_LAT))
+		message_set(target, FIT_LAP_FIELD_NUM_START_POSITION_LAT, fit_pos_to_rb(mesg->start_position_lat));
+	if(mesg->start_position_long != FIT_SINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_START_POSITION_LONG))
+		message_set(target, FIT_LAP_FIELD_NUM_START_POSITION_LONG, fit_pos_to_rb(mesg->start_position_long));
+	if(mesg->end_position_lat != FIT_SINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_END_POSITION_LAT))
+		message_set(target, FIT_LAP_FIELD_NUM_END_POSITION_LAT, fit_pos_to_rb(mesg->end_position_lat));
+	if(mesg->end_position_long != FIT_SINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_END_POSITION_LONG))
+		message_set(target, FIT_LAP_FIELD_NUM_END_POSITION_LONG, fit_pos_to_rb(mesg->end_position_long));
+	if(mesg->total_elapsed_time != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_ELAPSED_TIME))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_ELAPSED_TIME, UINT2NUM(mesg->total_elapsed_time));
+	if(mesg->total_timer_time != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_TIMER_TIME))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_TIMER_TIME, rb_float_new(mesg->total_timer_time / 1000.0));
+	if(mesg->total_distance != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_DISTANCE))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_DISTANCE, rb_float_new(mesg->total_distance / 100.0));
+	if(mesg->total_cycles != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_CYCLES))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_CYCLES, UINT2NUM(mesg->total_cycles));
+	if(mesg->message_index != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MESSAGE_INDEX))
+		message_set(target, FIT_LAP_FIELD_NUM_MESSAGE_INDEX, UINT2NUM(mesg->message_index));
+	if(mesg->total_calories != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_CALORIES))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_CALORIES, UINT2NUM(mesg->total_calories));
+	if(mesg->total_fat_calories != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_FAT_CALORIES))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_FAT_CALORIES, UINT2NUM(mesg->total_fat_calories));
+	if(mesg->avg_speed != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_AVG_SPEED))
+		message_set(target, FIT_LAP_FIELD_NUM_AVG_SPEED, rb_float_new(mesg->avg_speed / 1000.0));
+	if(mesg->max_speed != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MAX_SPEED))
+		message_set(target, FIT_LAP_FIELD_NUM_MAX_SPEED, rb_float_new(mesg->max_speed / 1000.0));
+	if(mesg->enhanced_avg_speed != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_ENHANCED_AVG_SPEED))
+		message_set(target, FIT_LAP_FIELD_NUM_ENHANCED_AVG_SPEED, rb_float_new(mesg->enhanced_avg_speed / 1000.0));
+	if(mesg->enhanced_max_speed != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_ENHANCED_MAX_SPEED))
+		message_set(target, FIT_LAP_FIELD_NUM_ENHANCED_MAX_SPEED, rb_float_new(mesg->enhanced_max_speed / 1000.0));
+	if(mesg->avg_altitude != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_AVG_ALTITUDE))
+		message_set(target, FIT_LAP_FIELD_NUM_AVG_ALTITUDE, rb_float_new(mesg->avg_altitude / 5.0 - 500));
+	if(mesg->max_altitude != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MAX_ALTITUDE))
+		message_set(target, FIT_LAP_FIELD_NUM_MAX_ALTITUDE, rb_float_new(mesg->max_altitude / 5.0 - 500));
+	if(mesg->min_altitude != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MIN_ALTITUDE))
+		message_set(target, FIT_LAP_FIELD_NUM_MIN_ALTITUDE, rb_float_new(mesg->min_altitude / 5.0 - 500));
+	if(mesg->enhanced_avg_altitude != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_ENHANCED_AVG_ALTITUDE))
+		message_set(target, FIT_LAP_FIELD_NUM_ENHANCED_AVG_ALTITUDE, rb_float_new(mesg->enhanced_avg_altitude / 5.0 - 500));
+	if(mesg->enhanced_max_altitude != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_ENHANCED_MAX_ALTITUDE))
+		message_set(target, FIT_LAP_FIELD_NUM_ENHANCED_MAX_ALTITUDE, rb_float_new(mesg->enhanced_max_altitude / 5.0 - 500));
+	if(mesg->enhanced_min_altitude != FIT_UINT32_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_ENHANCED_MIN_ALTITUDE))
+		message_set(target, FIT_LAP_FIELD_NUM_ENHANCED_MIN_ALTITUDE, rb_float_new(mesg->enhanced_min_altitude / 5.0 - 500));
+	if(mesg->avg_power != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_AVG_POWER))
+		message_set(target, FIT_LAP_FIELD_NUM_AVG_POWER, UINT2NUM(mesg->avg_power));
+	if(mesg->max_power != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MAX_POWER))
+		message_set(target, FIT_LAP_FIELD_NUM_MAX_POWER, UINT2NUM(mesg->max_power));
+	if(mesg->total_ascent != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_ASCENT))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_ASCENT, UINT2NUM(mesg->total_ascent));
+	if(mesg->total_descent != FIT_UINT16_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_TOTAL_DESCENT))
+		message_set(target, FIT_LAP_FIELD_NUM_TOTAL_DESCENT, UINT2NUM(mesg->total_descent));
+	if(mesg->event != FIT_EVENT_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_EVENT))
+		message_set(target, FIT_LAP_FIELD_NUM_EVENT, CHR2FIX(mesg->event));
+	if(mesg->event_type != FIT_EVENT_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_EVENT_TYPE))
+		message_set(target, FIT_LAP_FIELD_NUM_EVENT_TYPE, CHR2FIX(mesg->event_type));
+	if(mesg->avg_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_AVG_HEART_RATE))
+		message_set(target, FIT_LAP_FIELD_NUM_AVG_HEART_RATE, UINT2NUM(mesg->avg_heart_rate));
+	if(mesg->max_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MAX_HEART_RATE))
+		message_set(target, FIT_LAP_FIELD_NUM_MAX_HEART_RATE, UINT2NUM(mesg->max_heart_rate));
+	if(mesg->avg_cadence != FIT_UINT8_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_AVG_CADENCE))
+		message_set(target, FIT_LAP_FIELD_NUM_AVG_CADENCE, UINT2NUM(mesg->avg_cadence));
+	if(mesg->max_cadence != FIT_UINT8_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_MAX_CADENCE))
+		message_set(target, FIT_LAP_FIELD_NUM_MAX_CADENCE, UINT2NUM(mesg->max_cadence));
+	if(mesg->intensity != FIT_INTENSITY_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_INTENSITY))
+		message_set(target, FIT_LAP_FIELD_NUM_INTENSITY, CHR2FIX(mesg->intensity));
+        if(mesg->lap_trigger != FIT_LAP_TRIGGER_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_LAP_TRIGGER))
+		message_set(target, FIT_LAP_FIELD_NUM_LAP_TRIGGER, CHR2FIX(mesg->lap_trigger));
+        if(mesg->sport != FIT_SPORT_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_SPORT))
+		message_set(target, FIT_LAP_FIELD_NUM_SPORT, CHR2FIX(mesg->sport));
+        if(mesg->event_group != FIT_UINT8_INVALID && message_wants(target, FIT_LAP_FIELD_NUM_EVENT_GROUP))
+		message_set(target, FIT_LAP_FIELD_NUM_EVENT_GROUP, UINT2NUM(mesg->event_group));
+}
+
+static void fill_session(const struct message_target *target, const FIT_SESSION_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_SESSION_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->start_time != FIT_DATE_TIME_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_START_TIME))
+		message_set(target, FIT_SESSION_FIELD_NUM_START_TIME, UINT2NUM(mesg->start_time + GARMIN_TIME_OFFSET));
+	if(mesg->start_position_lat != FIT_SINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_START_POSITION_LAT))
+		message_set(target, FIT_SESSION_FIELD_NUM_START_POSITION_LAT, fit_pos_to_rb(mesg->start_position_lat));
+	if(mesg->start_position_long != FIT_SINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_START_POSITION_LONG))
+		message_set(target, FIT_SESSION_FIELD_NUM_START_POSITION_LONG, fit_pos_to_rb(mesg->start_position_long));
+	if(mesg->total_elapsed_time != FIT_UINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_ELAPSED_TIME))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_ELAPSED_TIME, rb_float_new(mesg->total_elapsed_time / 1000.0));
+	if(mesg->total_timer_time != FIT_UINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_TIMER_TIME))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_TIMER_TIME, rb_float_new(mesg->total_timer_time / 1000.0));
+	if(mesg->total_distance != FIT_UINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_DISTANCE))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_DISTANCE, rb_float_new(mesg->total_distance / 100.0));
+	if(mesg->total_cycles != FIT_UINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_CYCLES))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_CYCLES, UINT2NUM(mesg->total_cycles));
+	if(mesg->nec_lat != FIT_SINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_NEC_LAT))
+		message_set(target, FIT_SESSION_FIELD_NUM_NEC_LAT, fit_pos_to_rb(mesg->nec_lat));
+	if(mesg->nec_long != FIT_SINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_NEC_LONG))
+		message_set(target, FIT_SESSION_FIELD_NUM_NEC_LONG, fit_pos_to_rb(mesg->nec_long));
+	if(mesg->swc_lat != FIT_SINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_SWC_LAT))
+		message_set(target, FIT_SESSION_FIELD_NUM_SWC_LAT, fit_pos_to_rb(mesg->swc_lat));
+	if(mesg->swc_long != FIT_SINT32_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_SWC_LONG))
+		message_set(target, FIT_SESSION_FIELD_NUM_SWC_LONG, fit_pos_to_rb(mesg->swc_long));
+	if(mesg->message_index != FIT_MESSAGE_INDEX_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_MESSAGE_INDEX))
+		message_set(target, FIT_SESSION_FIELD_NUM_MESSAGE_INDEX, UINT2NUM(mesg->message_index));
+	if(mesg->total_calories != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_CALORIES))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_CALORIES, UINT2NUM(mesg->total_calories));
+	if(mesg->total_fat_calories != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_FAT_CALORIES))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_FAT_CALORIES, UINT2NUM(mesg->total_fat_calories));
+	if(mesg->avg_speed != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_AVG_SPEED))
+		message_set(target, FIT_SESSION_FIELD_NUM_AVG_SPEED, rb_float_new(mesg->avg_speed / 1000.0));
+	if(mesg->max_speed != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_MAX_SPEED))
+		message_set(target, FIT_SESSION_FIELD_NUM_MAX_SPEED, rb_float_new(mesg->max_speed / 1000.0));
+	if(mesg->avg_power != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_AVG_POWER))
+		message_set(target, FIT_SESSION_FIELD_NUM_AVG_POWER, UINT2NUM(mesg->avg_power));
+	if(mesg->max_power != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_MAX_POWER))
+		message_set(target, FIT_SESSION_FIELD_NUM_MAX_POWER, UINT2NUM(mesg->max_power));
+	if(mesg->total_ascent != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_ASCENT))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_ASCENT, UINT2NUM(mesg->total_ascent));
+	if(mesg->total_descent != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_DESCENT))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_DESCENT, UINT2NUM(mesg->total_descent));
+	if(mesg->first_lap_index != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_FIRST_LAP_INDEX))
+		message_set(target, FIT_SESSION_FIELD_NUM_FIRST_LAP_INDEX, UINT2NUM(mesg->first_lap_index));
+	if(mesg->num_laps != FIT_UINT16_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_NUM_LAPS))
+		message_set(target, FIT_SESSION_FIELD_NUM_NUM_LAPS, UINT2NUM(mesg->num_laps));
+	if(mesg->event != FIT_EVENT_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_EVENT))
+		message_set(target, FIT_SESSION_FIELD_NUM_EVENT, CHR2FIX(mesg->event));
+	if(mesg->event_type != FIT_EVENT_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_EVENT_TYPE))
+		message_set(target, FIT_SESSION_FIELD_NUM_EVENT_TYPE, CHR2FIX(mesg->event_type));
+	if(mesg->avg_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_AVG_HEART_RATE))
+		message_set(target, FIT_SESSION_FIELD_NUM_AVG_HEART_RATE, UINT2NUM(mesg->avg_heart_rate));
+	if(mesg->max_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_MAX_HEART_RATE))
+		message_set(target, FIT_SESSION_FIELD_NUM_MAX_HEART_RATE, UINT2NUM(mesg->max_heart_rate));
+	if(mesg->avg_cadence != FIT_UINT8_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_AVG_CADENCE))
+		message_set(target, FIT_SESSION_FIELD_NUM_AVG_CADENCE, UINT2NUM(mesg->avg_cadence));
+	if(mesg->max_cadence != FIT_UINT8_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_MAX_CADENCE))
+		message_set(target, FIT_SESSION_FIELD_NUM_MAX_CADENCE, UINT2NUM(mesg->max_cadence));
+	if(mesg->sport != FIT_SPORT_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_SPORT))
+		message_set(target, FIT_SESSION_FIELD_NUM_SPORT, CHR2FIX(mesg->sport));
+	if(mesg->sub_sport != FIT_SUB_SPORT_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_SUB_SPORT))
+		message_set(target, FIT_SESSION_FIELD_NUM_SUB_SPORT, CHR2FIX(mesg->sub_sport));
+	if(mesg->event_group != FIT_UINT8_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_EVENT_GROUP))
+		message_set(target, FIT_SESSION_FIELD_NUM_EVENT_GROUP, UINT2NUM(mesg->event_group));
+	if(mesg->total_training_effect != FIT_UINT8_INVALID && message_wants(target, FIT_SESSION_FIELD_NUM_TOTAL_TRAINING_EFFECT))
+		message_set(target, FIT_SESSION_FIELD_NUM_TOTAL_TRAINING_EFFECT, UINT2NUM(mesg->total_training_effect));
+}
+
+static void fill_user_profile(const struct message_target *target, const FIT_USER_PROFILE_MESG *mesg) {
+        if(*mesg->friendly_name != FIT_STRING_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_FRIENDLY_NAME))
+	        message_set(target, FIT_USER_PROFILE_FIELD_NUM_FRIENDLY_NAME, rb_str_new2(mesg->friendly_name));
+	if(mesg->message_index != FIT_MESSAGE_INDEX_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_MESSAGE_INDEX))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_MESSAGE_INDEX, UINT2NUM(mesg->message_index));
+	if(mesg->weight != FIT_UINT16_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_WEIGHT))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_WEIGHT, rb_float_new(mesg->weight / 10.0));
+	if(mesg->gender != FIT_GENDER_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_GENDER))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_GENDER, UINT2NUM(mesg->gender));
+	if(mesg->age != FIT_UINT8_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_AGE))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_AGE, UINT2NUM(mesg->age));
+	if(mesg->height != FIT_UINT8_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_HEIGHT))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_HEIGHT, rb_float_new(mesg->height / 100.0));
+	if(mesg->language != FIT_LANGUAGE_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_LANGUAGE))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_LANGUAGE, UINT2NUM(mesg->language));
+	if(mesg->elev_setting != FIT_DISPLAY_MEASURE_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_ELEV_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_ELEV_SETTING, UINT2NUM(mesg->elev_setting));
+	if(mesg->weight_setting != FIT_DISPLAY_MEASURE_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_WEIGHT_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_WEIGHT_SETTING, UINT2NUM(mesg->weight_setting));
+	if(mesg->resting_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_RESTING_HEART_RATE))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_RESTING_HEART_RATE, UINT2NUM(mesg->resting_heart_rate));
+	if(mesg->default_max_running_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_RUNNING_HEART_RATE))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_RUNNING_HEART_RATE, UINT2NUM(mesg->default_max_running_heart_rate));
+	if(mesg->default_max_biking_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_BIKING_HEART_RATE))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_BIKING_HEART_RATE, UINT2NUM(mesg->default_max_biking_heart_rate));
+	if(mesg->default_max_heart_rate != FIT_UINT8_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_HEART_RATE))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_DEFAULT_MAX_HEART_RATE, UINT2NUM(mesg->default_max_heart_rate));
+	if(mesg->hr_setting != FIT_DISPLAY_HEART_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_HR_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_HR_SETTING, UINT2NUM(mesg->hr_setting));
+	if(mesg->speed_setting != FIT_DISPLAY_MEASURE_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_SPEED_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_SPEED_SETTING, UINT2NUM(mesg->speed_setting));
+	if(mesg->dist_setting != FIT_DISPLAY_MEASURE_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_DIST_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_DIST_SETTING, UINT2NUM(mesg->dist_setting));
+	if(mesg->power_setting != FIT_DISPLAY_POWER_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_POWER_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_POWER_SETTING, UINT2NUM(mesg->power_setting));
+	if(mesg->activity_class != FIT_ACTIVITY_CLASS_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_ACTIVITY_CLASS))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_ACTIVITY_CLASS, UINT2NUM(mesg->activity_class));
+	if(mesg->position_setting != FIT_DISPLAY_POSITION_INVALID && message_wants(target, FIT_USER_PROFILE_FIELD_NUM_POSITION_SETTING))
+		message_set(target, FIT_USER_PROFILE_FIELD_NUM_POSITION_SETTING, UINT2NUM(mesg->position_setting));
+}
+
+static void fill_event(const struct message_target *target, const FIT_EVENT_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_EVENT_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_EVENT_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->data != FIT_UINT32_INVALID && message_wants(target, FIT_EVENT_FIELD_NUM_DATA))
+                message_set(target, FIT_EVENT_FIELD_NUM_DATA, UINT2NUM(mesg->data));
+	if(mesg->data16 != FIT_UINT16_INVALID && message_wants(target, FIT_EVENT_FIELD_NUM_DATA16))
+                message_set(target, FIT_EVENT_FIELD_NUM_DATA16, UINT2NUM(mesg->data16));
+	if(mesg->event != FIT_EVENT_INVALID && message_wants(target, FIT_EVENT_FIELD_NUM_EVENT))
+                message_set(target, FIT_EVENT_FIELD_NUM_EVENT, CHR2FIX(mesg->event));
+	if(mesg->event_type != FIT_EVENT_TYPE_INVALID && message_wants(target, FIT_EVENT_FIELD_NUM_EVENT_TYPE))
+		message_set(target, FIT_EVENT_FIELD_NUM_EVENT_TYPE, CHR2FIX(mesg->event_type));
+	if(mesg->event_group != FIT_UINT8_INVALID && message_wants(target, FIT_EVENT_FIELD_NUM_EVENT_GROUP))
+	        message_set(target, FIT_EVENT_FIELD_NUM_EVENT_GROUP, UINT2NUM(mesg->event_group));
+}
+
+static void fill_device_info(const struct message_target *target, const FIT_DEVICE_INFO_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->serial_number != FIT_UINT32Z_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_SERIAL_NUMBER))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_SERIAL_NUMBER, UINT2NUM(mesg->serial_number));
+	if(mesg->manufacturer != FIT_MANUFACTURER_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_MANUFACTURER))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_MANUFACTURER, UINT2NUM(mesg->manufacturer));
+	if(mesg->product != FIT_UINT16_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_PRODUCT))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_PRODUCT, UINT2NUM(mesg->product));
+	if(mesg->software_version != FIT_UINT16_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_SOFTWARE_VERSION))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_SOFTWARE_VERSION, UINT2NUM(mesg->software_version));
+	if(mesg->battery_voltage != FIT_UINT16_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_BATTERY_VOLTAGE))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_BATTERY_VOLTAGE, UINT2NUM(mesg->battery_voltage));
+	if(mesg->device_index != FIT_DEVICE_INDEX_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_DEVICE_INDEX))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_DEVICE_INDEX, UINT2NUM(mesg->device_index));
+	if(mesg->device_type != FIT_ANTPLUS_DEVICE_TYPE_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_DEVICE_TYPE))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_DEVICE_TYPE, UINT2NUM(mesg->device_type));
+	if(mesg->hardware_version != FIT_UINT8_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_HARDWARE_VERSION))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_HARDWARE_VERSION, UINT2NUM(mesg->hardware_version));
+	if(mesg->battery_status != FIT_BATTERY_STATUS_INVALID && message_wants(target, FIT_DEVICE_INFO_FIELD_NUM_BATTERY_STATUS))
+		message_set(target, FIT_DEVICE_INFO_FIELD_NUM_BATTERY_STATUS, UINT2NUM(mesg->battery_status));
+}
+
+static void fill_weight_scale(const struct message_target *target, const FIT_WEIGHT_SCALE_MESG *mesg) {
+	if(mesg->timestamp != FIT_DATE_TIME_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_TIMESTAMP))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_TIMESTAMP, UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
+	if(mesg->weight != FIT_WEIGHT_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_WEIGHT))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_WEIGHT, rb_float_new(mesg->weight / 100.0));
+	if(mesg->percent_fat != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_PERCENT_FAT))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_PERCENT_FAT, rb_float_new(mesg->percent_fat / 100.0));
+	if(mesg->percent_hydration != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_PERCENT_HYDRATION))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_PERCENT_HYDRATION, rb_float_new(mesg->percent_hydration / 100.0));
+	if(mesg->visceral_fat_mass != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_VISCERAL_FAT_MASS))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_VISCERAL_FAT_MASS, rb_float_new(mesg->visceral_fat_mass / 100.0));
+	if(mesg->bone_mass != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_BONE_MASS))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_BONE_MASS, rb_float_new(mesg->bone_mass / 100.0));
+	if(mesg->muscle_mass != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_MUSCLE_MASS))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_MUSCLE_MASS, rb_float_new(mesg->muscle_mass / 100.0));
+	if(mesg->basal_met != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_BASAL_MET))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_BASAL_MET, rb_float_new(mesg->basal_met / 4.0));
+	if(mesg->active_met != FIT_UINT16_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_ACTIVE_MET))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_ACTIVE_MET, rb_float_new(mesg->active_met / 4.0));
+	if(mesg->physique_rating != FIT_UINT8_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_PHYSIQUE_RATING))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_PHYSIQUE_RATING, rb_float_new(mesg->physique_rating));
+	if(mesg->metabolic_age != FIT_UINT8_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_METABOLIC_AGE))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_METABOLIC_AGE, rb_float_new(mesg->metabolic_age));
+	if(mesg->visceral_fat_rating != FIT_UINT8_INVALID && message_wants(target, FIT_WEIGHT_SCALE_FIELD_NUM_VISCERAL_FAT_RATING))
+		message_set(target, FIT_WEIGHT_SCALE_FIELD_NUM_VISCERAL_FAT_RATING, rb_float_new(mesg->visceral_fat_rating));
+}
+
+static void fill_message(const struct message_target *target, size_t message, const void *mesg) {
+	switch(message) {
+		case MESSAGE_ACTIVITY:
+			fill_activity(target, mesg);
+			break;
+		case MESSAGE_DEVICE_INFO:
+			fill_device_info(target, mesg);
+			break;
+		case MESSAGE_EVENT:
+			fill_event(target, mesg);
+			break;
+		case MESSAGE_LAP:
+			fill_lap(target, mesg);
+			break;
+		case MESSAGE_RECORD:
+			fill_record(target, mesg);
+			break;
+		case MESSAGE_SESSION:
+			fill_session(target, mesg);
+			break;
+		case MESSAGE_USER_PROFILE:
+			fill_user_profile(target, mesg);
+			break;
+		case MESSAGE_WEIGHT_SCALE:
+			fill_weight_scale(target, mesg);
+			break;
+	}
+}
+
+/*
+ * RubyFit::LazyMessage keeps a copy of the decoded message and converts a
+ * field only when it is read.
+ */
+struct lazy_message {
+	size_t message;
+	const VALUE *keys; // For to_h.
+	union message_data data;
+};
+
+static const rb_data_type_t lazy_message_type = {
+	"RubyFit::LazyMessage",
+	{ NULL, RUBY_TYPED_DEFAULT_FREE, NULL, },
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE cLazyMessage;
+static VALUE lazy_message_classes[MESSAGES];
+static ID message_field_ids[MESSAGES][256];
+
+static VALUE lazy_message_new(const struct message_format *format, size_t message, const void *mesg) {
+	struct lazy_message *lazy;
+	VALUE object;
+
+	if(format->reused && !NIL_P(format->reused[message])) {
+		object = format->reused[message];
+		TypedData_Get_Struct(object, struct lazy_message, &lazy_message_type, lazy);
+	} else {
+		object = TypedData_Make_Struct(lazy_message_classes[message], struct lazy_message, &lazy_message_type, lazy);
+		lazy->message = message;
+		lazy->keys = format->keys[message];
+
+		if(format->reused)
+			format->reused[message] = object;
+	}
+
+	memcpy(&lazy->data, mesg, sizeof(lazy->data));
+	return object;
+}
+
+/*
+ * LazyMessages are only made by the parser, but can be dup'ed out of a
+ * reused one.
+ */
+static VALUE lazy_message_alloc(VALUE klass) {
+	struct lazy_message *lazy;
+	VALUE object = TypedData_Make_Struct(klass, struct lazy_message, &lazy_message_type, lazy);
+
+	lazy->message = MESSAGES;
+	return object;
+}
+
+static VALUE lazy_message_init_copy(VALUE self, VALUE orig) {
+	struct lazy_message *lazy, *orig_lazy;
+
+	if(self == orig)
+		return self;
+
+	rb_obj_init_copy(self, orig);
+	TypedData_Get_Struct(self, struct lazy_message, &lazy_message_type, lazy);
+	TypedData_Get_Struct(orig, struct lazy_message, &lazy_message_type, orig_lazy);
+	*lazy = *orig_lazy;
+	return self;
+}
+
+static VALUE lazy_message_value(VALUE self, ID name) {
+	struct lazy_message *lazy;
+	struct message_target target;
+	VALUE value = Qnil;
+	size_t i;
+
+	TypedData_Get_Struct(self, struct lazy_message, &lazy_message_type, lazy);
+	if(lazy->message >= MESSAGES)
+		return Qnil;
+
+	for(i = 0; i < message_names[lazy->message].num_fields; i++) {
+		if(message_field_ids[lazy->message][i] == name)
+			break;
+	}
+
+	if(i == message_names[lazy->message].num_fields)
+		return Qnil;
+
+	target.object = Qnil;
+	target.keys = NULL;
+	target.members = NULL;
+	target.field = message_names[lazy->message].fields[i].field_num;
+	target.value = &value;
+	fill_message(&target, lazy->message, lazy->data.bytes);
+	return value;
+}
+
+/*
+ * LazyMessage#[](name), nil for fields the message doesn't have.
+ */
+static VALUE lazy_message_aref(VALUE self, VALUE name) {
+	ID id;
+
+	if(SYMBOL_P(name)) {
+		id = SYM2ID(name);
+	} else {
+		id = rb_check_id(&name);
+		if(!id)
+			return Qnil;
+	}
+
+	return lazy_message_value(self, id);
+}
+
+/*
+ * Accessor of each field, e.g. LazyMessage::Record#timestamp.
+ */
+static VALUE lazy_message_field(VALUE self) {
+	return lazy_message_value(self, rb_frame_this_func());
+}
+
+/*
+ * LazyMessage#to_h, the same hash the message would be passed as.
+ */
+static VALUE lazy_message_to_h(VALUE self) {
+	struct lazy_message *lazy;
+	struct message_target target;
+
+	TypedData_Get_Struct(self, struct lazy_message, &lazy_message_type, lazy);
+	if(lazy->message >= MESSAGES)
+		return rb_hash_new();
+
+	target.object = message_hash_new(lazy->message);
+	target.keys = lazy->keys;
+	target.members = NULL;
+	target.field = MESSAGE_FIELDS_ALL;
+	target.value = NULL;
+	fill_message(&target, lazy->message, lazy->data.bytes);
+	return target.object;
+}
+
+static VALUE message_object(const struct message_format *format, size_t message, const void *mesg) {
+	struct message_target target;
+
+	if(format->lazy)
+		return lazy_message_new(format, message, mesg);
+
+	fill_message(message_target(&target, format, message), message, mesg);
+	return target.object;
+}
+
+static void pass_mesg(VALUE handler, const struct message_format *format, size_t message, const void *mesg) {
+	rb_funcall(handler, message_callbacks[message], 1, message_object(format, message, mesg));
+}
+
+static void pass_records(VALUE handler, VALUE *records) {
+	if(!NIL_P(*records)) {
+		rb_funcall(handler, id_on_records, 1, *records);
+		*records = Qnil;
+	}
+}
+
+/*
+ * Columns of RubyFit::RecordColumns, in the order of record_fields.  Each
+ * column is a String of packed native doubles ('d'), 32-bit ('l') or 64-bit
+ * ('q') integers, one per record, along with a bitmap of the records that
+ * have a valid value for the field.
+ */
+static const struct {
+	FIT_UINT8 field_num;
+	char type;
+} record_columns[] = {
+	{ FIT_RECORD_FIELD_NUM_TIMESTAMP, 'q' },
+	{ FIT_RECORD_FIELD_NUM_POSITION_LAT, 'd' },
+	{ FIT_RECORD_FIELD_NUM_POSITION_LONG, 'd' },
+	{ FIT_RECORD_FIELD_NUM_DISTANCE, 'd' },
+	{ FIT_RECORD_FIELD_NUM_TIME_FROM_COURSE, 'd' },
+	{ FIT_RECORD_FIELD_NUM_HEART_RATE, 'l' },
+	{ FIT_RECORD_FIELD_NUM_ALTITUDE, 'd' },
+	{ FIT_RECORD_FIELD_NUM_ENHANCED_ALTITUDE, 'd' },
+	{ FIT_RECORD_FIELD_NUM_SPEED, 'd' },
+	{ FIT_RECORD_FIELD_NUM_ENHANCED_SPEED, 'd' },
+	{ FIT_RECORD_FIELD_NUM_GRADE, 'd' },
+	{ FIT_RECORD_FIELD_NUM_POWER, 'l' },
+	{ FIT_RECORD_FIELD_NUM_CADENCE, 'l' },
+	{ FIT_RECORD_FIELD_NUM_RESISTANCE, 'l' },
+	{ FIT_RECORD_FIELD_NUM_CYCLE_LENGTH, 'l' },
+	{ FIT_RECORD_FIELD_NUM_TEMPERATURE, 'l' },
+	{ FIT_RECORD_FIELD_NUM_LEFT_RIGHT_BALANCE, 'l' },
+	{ FIT_RECORD_FIELD_NUM_LEFT_TORQUE_EFFECTIVENESS, 'l' },
+	{ FIT_RECORD_FIELD_NUM_RIGHT_TORQUE_EFFECTIVENESS, 'l' },
+	{ FIT_RECORD_FIELD_NUM_LEFT_PEDAL_SMOOTHNESS, 'l' },
+	{ FIT_RECORD_FIELD_NUM_RIGHT_PEDAL_SMOOTHNESS, 'l' },
+	{ FIT_RECORD_FIELD_NUM_COMBINED_PEDAL_SMOOTHNESS, 'l' }
+};
+
+#define RECORD_COLUMNS (sizeof(record_columns) / sizeof(record_columns[0]))
+
+struct record_column_buffers {
+	long size;
+	VALUE data[RECORD_COLUMNS];
+	VALUE valid[RECORD_COLUMNS];
+};
+
+static VALUE cRecordColumns;
+
+static void push_record_columns(struct record_column_buffers *columns, const FIT_RECORD_MESG *mesg) {
+	const long row = columns->size++;
+	size_t i;
+
+	for(i = 0; i < RECORD_COLUMNS; i++) {
+		union {
+			double d;
+			FIT_SINT32 l;
+			FIT_SINT64 q;
+		} value;
+		int valid = 0;
+
+		memset(&value, 0, sizeof(value));
+
+		switch(record_columns[i].field_num) {
+			case FIT_RECORD_FIELD_NUM_TIMESTAMP:
+				valid = mesg->timestamp != FIT_DATE_TIME_INVALID;
+				value.q = (FIT_SINT64) mesg->timestamp + GARMIN_TIME_OFFSET;
+				break;
+			case FIT_RECORD_FIELD_NUM_POSITION_LAT:
+				valid = mesg->position_lat != FIT_SINT32_INVALID;
+				value.d = fit_pos_to_degrees(mesg->position_lat);
+				break;
+			case FIT_RECORD_FIELD_NUM_POSITION_LONG:
+				valid = mesg->position_long != FIT_SINT32_INVALID;
+				value.d = fit_pos_to_degrees(mesg->position_long);
+				break;
+			case FIT_RECORD_FIELD_NUM_DISTANCE:
+				valid = mesg->distance != FIT_UINT32_INVALID;
+				value.d = mesg->distance / 100.0;
+				break;
+			case FIT_RECORD_FIELD_NUM_TIME_FROM_COURSE:
+				valid = mesg->time_from_course != FIT_SINT32_INVALID;
+				value.d = mesg->time_from_course / 1000.0;
+				break;
+			case FIT_RECORD_FIELD_NUM_HEART_RATE:
+				valid = mesg->heart_rate != FIT_UINT8_INVALID;
+				value.l = mesg->heart_rate;
+				break;
+			case FIT_RECORD_FIELD_NUM_ALTITUDE:
+				valid = mesg->altitude != FIT_UINT16_INVALID;
+				value.d = mesg->altitude / 5.0 - 500;
+				break;
+			case FIT_RECORD_FIELD_NUM_ENHANCED_ALTITUDE:
+				valid = mesg->enhanced_altitude != FIT_UINT32_INVALID;
+				value.d = mesg->enhanced_altitude / 5.0 - 500;
+				break;
+			case FIT_RECORD_FIELD_NUM_SPEED:
+				valid = mesg->speed != FIT_UINT16_INVALID;
+				value.d = mesg->speed / 1000.0;
+				break;
+			case FIT_RECORD_FIELD_NUM_ENHANCED_SPEED:
+				valid = mesg->enhanced_speed != FIT_UINT32_INVALID;
+				value.d = mesg->enhanced_speed / 1000.0;
+				break;
+			case FIT_RECORD_FIELD_NUM_GRADE:
+				valid = mesg->grade != FIT_SINT16_INVALID;
+				value.d = mesg->grade / 100.0;
+				break;
+			case FIT_RECORD_FIELD_NUM_POWER:
+				valid = mesg->power != FIT_UINT16_INVALID;
+				value.l = mesg->power;
+				break;
+			case FIT_RECORD_FIELD_NUM_CADENCE:
+				valid = mesg->cadence != FIT_UINT8_INVALID;
+				value.l = mesg->cadence;
+				break;
+			case FIT_RECORD_FIELD_NUM_RESISTANCE:
+				valid = mesg->resistance != FIT_UINT8_INVALID;
+				value.l = mesg->resistance;
+				break;
+			case FIT_RECORD_FIELD_NUM_CYCLE_LENGTH:
+				valid = mesg->cycle_length != FIT_UINT8_INVALID;
+				value.l = mesg->cycle_length;
+				break;
+			case FIT_RECORD_FIELD_NUM_TEMPERATURE:
+				valid = mesg->temperature != FIT_SINT8_INVALID;
+				value.l = mesg->temperature;
+				break;
+			case FIT_RECORD_FIELD_NUM_LEFT_RIGHT_BALANCE:
+				valid = mesg->left_right_balance != FIT_UINT8_INVALID;
+				value.l = mesg->left_right_balance & FIT_LEFT_RIGHT_BALANCE_MASK;
+				break;
+			case FIT_RECORD_FIELD_NUM_LEFT_TORQUE_EFFECTIVENESS:
+				valid = mesg->left_torque_effectiveness != FIT_UINT8_INVALID;
+				value.l = mesg->left_torque_effectiveness;
+				break;
+			case FIT_RECORD_FIELD_NUM_RIGHT_TORQUE_EFFECTIVENESS:
+				valid = mesg->right_torque_effectiveness != FIT_UINT8_INVALID;
+				value.l = mesg->right_torque_effectiveness;
+				break;
+			case FIT_RECORD_FIELD_NUM_LEFT_PEDAL_SMOOTHNESS:
+				valid = mesg->left_pedal_smoothness != FIT_UINT8_INVALID;
+				value.l = mesg->left_pedal_smoothness;
+				break;
+			case FIT_RECORD_FIELD_NUM_RIGHT_PEDAL_SMOOTHNESS:
+				valid = mesg->right_pedal_smoothness != FIT_UINT8_INVALID;
+				value.l = mesg->right_pedal_smoothness;
+				break;
+			case FIT_RECORD_FIELD_NUM_COMBINED_PEDAL_SMOOTHNESS:
+				valid = mesg->combined_pedal_smoothness != FIT_UINT8_INVALID;
+				value.l = mesg->combined_pedal_smoothness;
+				break;
+		}
+
+		switch(record_columns[i].type) {
+			case 'd':
+				rb_str_cat(columns->data[i], (const char *) &value.d, sizeof(value.d));
+				break;
+			case 'l':
+				rb_str_cat(columns->data[i], (const char *) &value.l, sizeof(value.l));
+				break;
+			case 'q':
+				rb_str_cat(columns->data[i], (const char *) &value.q, sizeof(value.q));
+				break;
+		}
+
+		if(row % 8 == 0)
+			rb_str_cat(columns->valid[i], "", 1);
+		if(valid)
+			RSTRING_PTR(columns->valid[i])[row / 8] |= 1 << (row % 8);
+	}
+}
+
+/*
+ * Messages are decoded without the GVL into a chunk of up to
+ * DECODE_CHUNK_MESSAGES, then passed to the handler with the GVL held.
+ */
+#define DECODE_CHUNK_MESSAGES 256
+
+struct decoded_message {
+	FIT_UINT16 mesg_num;
+	FIT_BOOL restored; // Activity after FitConvert_RestoreFields, only reported to print_msg.
+	union message_data data;
+};
+
+struct decode_chunk {
+	FIT_CONVERT_STATE *state;
+	const void *data;
+	FIT_UINT32 size;
+	struct decoded_message *messages;
+	size_t num_messages;
+	FIT_CONVERT_RETURN convert_return;
+	volatile int interrupted;
+};
+
+/*
+ * Bytes of the decoded message that are passed on, 0 for messages that are
+ * only reported as unknown.
+ */
+static size_t decoded_message_size(FIT_UINT16 mesg_num) {
+	switch(mesg_num) {
+		case FIT_MESG_NUM_USER_PROFILE:
+			return sizeof(FIT_USER_PROFILE_MESG);
+		case FIT_MESG_NUM_ACTIVITY:
+			return sizeof(FIT_ACTIVITY_MESG);
+		case FIT_MESG_NUM_SESSION:
+			return sizeof(FIT_SESSION_MESG);
+		case FIT_MESG_NUM_LAP:
+			return sizeof(FIT_LAP_MESG);
+		case FIT_MESG_NUM_RECORD:
+			return sizeof(FIT_RECORD_MESG);
+		case FIT_MESG_NUM_EVENT:
+			return sizeof(FIT_EVENT_MESG);
+		case FIT_MESG_NUM_DEVICE_INFO:
+			return sizeof(FIT_DEVICE_INFO_MESG);
+		case FIT_MESG_NUM_WEIGHT_SCALE:
+			return sizeof(FIT_WEIGHT_SCALE_MESG);
+		default:
+			return 0;
+	}
+}
+
+static struct decoded_message *push_decoded_message(struct decode_chunk *chunk, FIT_UINT16 mesg_num, FIT_BOOL restored) {
+	struct decoded_message *message = &chunk->messages[chunk->num_messages++];
+
+	message->mesg_num = mesg_num;
+	message->restored = restored;
+	memcpy(message->data.bytes, FitConvert_GetMessageData(chunk->state), decoded_message_size(mesg_num));
+	return message;
+}
+
+/*
+ * Runs without the GVL: must not touch any Ruby object.
+ */
+static void *decode_chunk(void *arg) {
+	struct decode_chunk *chunk = arg;
+
+	chunk->num_messages = 0;
+
+	do {
+		FIT_UINT16 mesg_num;
+
+		chunk->convert_return = FitConvert_Read(chunk->state, chunk->data, chunk->size);
+
+		if(chunk->convert_return != FIT_CONVERT_MESSAGE_AVAILABLE)
+			break;
+
+		mesg_num = FitConvert_GetMessageNumber(chunk->state);
+
+		if(mesg_num == FIT_MESG_NUM_FILE_ID)
+			continue;
+
+		push_decoded_message(chunk, mesg_num, FIT_FALSE);
+
+		if(mesg_num == FIT_MESG_NUM_ACTIVITY) {
+			FIT_ACTIVITY_MESG old_mesg;
+			memset(&old_mesg, 0xFF, sizeof(old_mesg));
+			old_mesg.num_sessions = 1;
+			FitConvert_RestoreFields(chunk->state, &old_mesg);
+			push_decoded_message(chunk, mesg_num, FIT_TRUE);
+		}
+	} while(chunk->num_messages < DECODE_CHUNK_MESSAGES - 1 && !chunk->interrupted);
+
+	return NULL;
+}
+
+static void stop_decoding(void *arg) {
+	((struct decode_chunk *) arg)->interrupted = 1;
+}
+
+enum parse_mode {
+	PARSE_HANDLER, // Pass messages to the handler's callbacks.
+	PARSE_EACH_MESSAGE, // Yield [mesg_num, message] for each message.
+	PARSE_EACH_RECORD // Yield each record.
+};
+
+enum parse_input {
+	PARSE_INPUT_UNKNOWN, // Not enough bytes seen to tell.
+	PARSE_INPUT_FIT,
+	PARSE_INPUT_GZIP
+};
+
+/*
+ * Everything a parse keeps between chunks of data.
+ */
+struct parse_context {
+	enum parse_mode mode;
+	VALUE handler;
+	unsigned int callbacks;
+	struct record_column_buffers *columns;
+	struct message_format format, batch_format;
+	long batch_size;
+	VALUE records;
+	VALUE reused[MESSAGES];
+	struct decoded_message *messages;
+	enum parse_input input;
+	FIT_UINT8 magic; // First byte of the input, while input is unknown.
+	int num_magic;
+	VALUE inflater; // Owns inflate, nil for uncompressed input.
+	struct parse_inflate *inflate;
+	VALUE unzipper; // Owns unzip, nil unless the input is a deflated ZIP entry.
+	struct parse_inflate *unzip; // Raw deflate in front of input detection.
+	FIT_CONVERT_RETURN convert_return;
+	FIT_CONVERT_STATE state;
+};
+
+static VALUE eParseError;
+
+static void parse_message(const struct parse_context *ctx, const char *msg) {
+	if(ctx->mode == PARSE_HANDLER)
+		pass_message(ctx->handler, msg);
+}
+
+static void parse_err_message(const struct parse_context *ctx, const char *msg) {
+	if(ctx->mode == PARSE_HANDLER)
+		pass_err_message(ctx->handler, msg);
+	else
+		rb_raise(eParseError, "%.*s", (int) strcspn(msg, "\n"), msg);
+}
+
+static void parse_mesg(const struct parse_context *ctx, size_t message, const void *mesg) {
+	switch(ctx->mode) {
+		case PARSE_HANDLER:
+			pass_mesg(ctx->handler, &ctx->format, message, mesg);
+			break;
+		case PARSE_EACH_MESSAGE:
+			rb_yield(rb_assoc_new(UINT2NUM(message_names[message].mesg_num), message_object(&ctx->format, message, mesg)));
+			break;
+		case PARSE_EACH_RECORD:
+			rb_yield(message_object(&ctx->format, message, mesg));
+			break;
+	}
+}
+
+static void parse_begin(struct parse_context *ctx, VALUE self, enum parse_mode mode, struct record_column_buffers *columns) {
+	VALUE message_filter = rb_ivar_get(self, rb_intern("@message_filter"));
+	VALUE field_filter = rb_ivar_get(self, rb_intern("@field_filter"));
+	VALUE batch_records = rb_ivar_get(self, rb_intern("@batch_records"));
+
+	ctx->mode = mode;
+	ctx->handler = rb_ivar_get(self, rb_intern("@handler"));
+	ctx->callbacks = mode == PARSE_HANDLER ? handler_callbacks(ctx->handler) : (1U << MESSAGES) - 1;
+	ctx->columns = columns;
+	ctx->batch_size = 0;
+	ctx->records = Qnil;
+	ctx->messages = NULL;
+	ctx->input = PARSE_INPUT_UNKNOWN;
+	ctx->num_magic = 0;
+	ctx->inflater = Qnil;
+	ctx->inflate = NULL;
+	ctx->unzipper = Qnil;
+	ctx->unzip = NULL;
+	ctx->convert_return = FIT_CONVERT_CONTINUE;
+	FitConvert_Init(&ctx->state, FIT_TRUE);
+
+	if(mode == PARSE_HANDLER && !NIL_P(batch_records) && rb_respond_to(ctx->handler, id_on_records))
+		ctx->batch_size = NUM2LONG(batch_records);
+
+	if(RTEST(rb_ivar_get(self, rb_intern("@structs"))))
+		ctx->format.keys = NULL;
+	else
+		ctx->format.keys = message_keys[RTEST(rb_ivar_get(self, rb_intern("@symbolize_keys"))) ? KEYS_SYMBOL : KEYS_STRING];
+
+	ctx->format.reused = NULL;
+	ctx->format.lazy = RTEST(rb_ivar_get(self, rb_intern("@lazy")));
+	ctx->batch_format = ctx->format;
+
+	if(RTEST(rb_ivar_get(self, rb_intern("@reuse_messages")))) {
+		size_t i;
+
+		for(i = 0; i < MESSAGES; i++)
+			ctx->reused[i] = Qnil;
+		ctx->format.reused = ctx->reused;
+	}
+
+	if(mode == PARSE_EACH_RECORD) {
+		// Nothing but records is yielded, so don't decode anything else.
+		FIT_UINT16 mesg_num = FIT_MESG_NUM_RECORD;
+		FitConvert_SetMessageFilter(&ctx->state, &mesg_num, NIL_P(message_filter) || RTEST(rb_ary_includes(message_filter, UINT2NUM(mesg_num))) ? 1 : 0);
+	} else if(!NIL_P(message_filter)) {
+		FIT_UINT16 mesg_nums[sizeof(message_names) / sizeof(message_names[0])];
+		FIT_UINT16 num_mesgs = 0;
+		long i;
+
+		for(i = 0; i < RARRAY_LEN(message_filter) && num_mesgs < sizeof(mesg_nums) / sizeof(mesg_nums[0]); i++)
+			mesg_nums[num_mesgs++] = NUM2USHORT(RARRAY_AREF(message_filter, i));
+
+		FitConvert_SetMessageFilter(&ctx->state, mesg_nums, num_mesgs);
+	}
+
+	if(!NIL_P(field_filter)) {
+		VALUE mesg_nums = rb_funcall(field_filter, rb_intern("keys"), 0);
+		long i;
+
+		for(i = 0; i < RARRAY_LEN(mesg_nums); i++) {
+			VALUE mesg_num = RARRAY_AREF(mesg_nums, i);
+			VALUE fields = rb_hash_aref(field_filter, mesg_num);
+			FIT_UINT8 field_nums[256];
+			FIT_UINT8 num_fields = 0;
+			long j;
+
+			for(j = 0; j < RARRAY_LEN(fields) && num_fields < sizeof(field_nums) - 1; j++)
+				field_nums[num_fields++] = NUM2UINT(RARRAY_AREF(fields, j));
+
+			FitConvert_SetFieldFilter(&ctx->state, NUM2USHORT(mesg_num), field_nums, num_fields);
+		}
+	}
+}
+
+/*
+ * Decodes the next bytes of the file and passes on the messages they
+ * complete.  ctx->messages must have room for DECODE_CHUNK_MESSAGES.
+ *
+ * Decodes without the GVL, a chunk of messages at a time, and passes each
+ * chunk on once the GVL is back.  The data must not change until this
+ * returns; the decoder keeps its offset into it between chunks.
+ */
+static void parse_bytes(struct parse_context *ctx, const void *data, FIT_UINT32 size) {
+	struct decode_chunk chunk;
+	char err_msg[128];
+
+	chunk.state = &ctx->state;
+	chunk.data = data;
+	chunk.size = size;
+	chunk.messages = ctx->messages;
+
+	do {
+		size_t i;
+
+		chunk.interrupted = 0;
+		rb_thread_call_without_gvl(decode_chunk, &chunk, stop_decoding, &chunk);
+		ctx->convert_return = chunk.convert_return;
+
+		for(i = 0; i < chunk.num_messages; i++) {
+			const FIT_UINT8 *mesg = chunk.messages[i].data.bytes;
+			FIT_UINT16 mesg_num = chunk.messages[i].mesg_num;
+
+			// Keep records in order with the messages around them.
+			if(mesg_num != FIT_MESG_NUM_RECORD)
+				pass_records(ctx->handler, &ctx->records);
+
+			switch(mesg_num) {
+				case FIT_MESG_NUM_USER_PROFILE: {
+					const FIT_USER_PROFILE_MESG *user_profile = (FIT_USER_PROFILE_MESG *) mesg;
+					if(ctx->callbacks & (1U << MESSAGE_USER_PROFILE))
+						parse_mesg(ctx, MESSAGE_USER_PROFILE, user_profile);
+					break;
+				}
+
+				case FIT_MESG_NUM_ACTIVITY: {
+					const FIT_ACTIVITY_MESG *activity = (FIT_ACTIVITY_MESG *) mesg;
+					if(chunk.messages[i].restored) {
+						sprintf(err_msg, "Restored num_sessions=1 - Activity: timestamp=%u, type=%u, event=%u, event_type=%u, num_sessions=%u\n", activity->timestamp, activity->type, activity->event, activity->event_type, activity->num_sessions);
+						parse_message(ctx, err_msg);
+					} else if(ctx->callbacks & (1U << MESSAGE_ACTIVITY)) {
+						parse_mesg(ctx, MESSAGE_ACTIVITY, activity);
+					}
+					break;
+				}
+
+				case FIT_MESG_NUM_SESSION: {
+					const FIT_SESSION_MESG *session = (FIT_SESSION_MESG *) mesg;
+					if(ctx->callbacks & (1U << MESSAGE_SESSION))
+						parse_mesg(ctx, MESSAGE_SESSION, session);
+					break;
+				}
+
+				case FIT_MESG_NUM_LAP: {
+					const FIT_LAP_MESG *lap = (FIT_LAP_MESG *) mesg;
+					if(ctx->callbacks & (1U << MESSAGE_LAP))
+						parse_mesg(ctx, MESSAGE_LAP, lap);
+					break;
+				}
+
+				case FIT_MESG_NUM_RECORD: {
+					const FIT_RECORD_MESG *record = (FIT_RECORD_MESG *) mesg;
+					if(ctx->columns) {
+						push_record_columns(ctx->columns, record);
+					} else if(ctx->batch_size > 0) {
+						if(NIL_P(ctx->records))
+							ctx->records = rb_ary_new_capa(ctx->batch_size);
+
+						rb_ary_push(ctx->records, message_object(&ctx->batch_format, MESSAGE_RECORD, record));
+
+						if(RARRAY_LEN(ctx->records) >= ctx->batch_size)
+							pass_records(ctx->handler, &ctx->records);
+					} else if(ctx->callbacks & (1U << MESSAGE_RECORD)) {
+						parse_mesg(ctx, MESSAGE_RECORD, record);
+					}
+					break;
+				}
+
+				case FIT_MESG_NUM_EVENT: {
+					const FIT_EVENT_MESG *event = (FIT_EVENT_MESG *) mesg;
+					if(ctx->callbacks & (1U << MESSAGE_EVENT))
+						parse_mesg(ctx, MESSAGE_EVENT, event);
+					break;
+				}
+
+				case FIT_MESG_NUM_DEVICE_INFO: {
+					const FIT_DEVICE_INFO_MESG *device_info = (FIT_DEVICE_INFO_MESG *) mesg;
+					if(ctx->callbacks & (1U << MESSAGE_DEVICE_INFO))
+						parse_mesg(ctx, MESSAGE_DEVICE_INFO, device_info);
+					break;
+				}
+
+				case FIT_MESG_NUM_WEIGHT_SCALE: {
+					const FIT_WEIGHT_SCALE_MESG *weight_scale_info = (FIT_WEIGHT_SCALE_MESG *) mesg;
+					if(ctx->callbacks & (1U << MESSAGE_WEIGHT_SCALE))
+						parse_mesg(ctx, MESSAGE_WEIGHT_SCALE, weight_scale_info);
+					break;
+				}
+
+				default: {
+					parse_message(ctx, "Unknown message\n");
+					break;
+				}
+			}
+		}
+
+		// Raises if the thread was interrupted while decoding.
+		rb_thread_check_ints();
+	} while (chunk.convert_return == FIT_CONVERT_MESSAGE_AVAILABLE);
+}
+
+#if defined(HAVE_ZLIB_H)
+#define INFLATE_CHUNK_SIZE 16384
+
+/*
+ * Inflates gzip compressed files in front of the decoder, a chunk at a time
+ * so the decompressed file is never in memory as a whole.
+ */
+struct parse_inflate {
+	z_stream z;
+	int status; // Of the last inflate().
+	FIT_UINT8 out[INFLATE_CHUNK_SIZE];
+};
+
+static void parse_inflate_free(void *ptr) {
+	struct parse_inflate *inflater = ptr;
+
+	inflateEnd(&inflater->z);
+	ruby_xfree(inflater);
+}
+
+static size_t parse_inflate_memsize(const void *ptr) {
+	return sizeof(struct parse_inflate);
+}
+
+static const rb_data_type_t parse_inflate_type = {
+	"RubyFit::FitParser::Inflate",
+	{ NULL, parse_inflate_free, parse_inflate_memsize, },
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Runs without the GVL: must not touch any Ruby object.
+ */
+static void *inflate_chunk(void *arg) {
+	struct parse_inflate *inflater = arg;
+
+	inflater->z.next_out = inflater->out;
+	inflater->z.avail_out = sizeof(inflater->out);
+	inflater->status = inflate(&inflater->z, Z_NO_FLUSH);
+	return NULL;
+}
+
+/*
+ * The inflater is owned by *owner, a member of ctx, which is on the stack or
+ * marks it; it is freed by the GC along with zlib's state, also when a
+ * callback raises.
+ */
+static struct parse_inflate *parse_inflate_new(VALUE *owner, int window_bits) {
+	struct parse_inflate *inflater;
+
+	*owner = TypedData_Make_Struct(0, struct parse_inflate, &parse_inflate_type, inflater);
+
+	if(inflateInit2(&inflater->z, window_bits) != Z_OK)
+		rb_raise(rb_eNoMemError, "failed to initialize zlib");
+
+	return inflater;
+}
+
+/*
+ * Inflates data a chunk at a time, passing each chunk to output.
+ */
+static void parse_inflate(struct parse_context *ctx, struct parse_inflate *inflater, const void *data, FIT_UINT32 size, void (*output)(struct parse_context *ctx, const void *data, FIT_UINT32 size)) {
+	inflater->z.next_in = (Bytef *) data;
+	inflater->z.avail_in = size;
+
+	do {
+		FIT_UINT32 inflated;
+
+		// Stop at the end of the compressed stream; anything after it is
+		// ignored.
+		if(inflater->status == Z_STREAM_END)
+			break;
+
+		rb_thread_call_without_gvl(inflate_chunk, inflater, NULL, NULL);
+
+		if(inflater->status != Z_OK && inflater->status != Z_STREAM_END && inflater->status != Z_BUF_ERROR) {
+			ctx->convert_return = FIT_CONVERT_ERROR;
+			break;
+		}
+
+		inflated = sizeof(inflater->out) - inflater->z.avail_out;
+		if(inflated > 0)
+			output(ctx, inflater->out, inflated);
+		else if(inflater->status == Z_BUF_ERROR)
+			break;
+	} while((inflater->z.avail_in > 0 || inflater->z.avail_out == 0) && ctx->convert_return == FIT_CONVERT_CONTINUE);
+
+	inflater->z.next_in = NULL;
+	inflater->z.avail_in = 0;
+}
+#endif
+
+/*
+ * Decodes the next bytes of a FIT file or a gzip compressed one, told apart
+ * by the first two bytes.
+ */
+static void parse_detect(struct parse_context *ctx, const void *data, FIT_UINT32 size) {
+	const FIT_UINT8 *bytes = data;
+
+	if(size == 0)
+		return;
+
+	if(ctx->input == PARSE_INPUT_UNKNOWN) {
+		// Wait for a second byte to tell.
+		if(ctx->num_magic == 0 && size == 1) {
+			ctx->magic = bytes[0];
+			ctx->num_magic = 1;
+			return;
+		}
+
+		ctx->input = PARSE_INPUT_FIT;
+
+#if defined(HAVE_ZLIB_H)
+		if((ctx->num_magic ? ctx->magic : bytes[0]) == 0x1F && (ctx->num_magic ? bytes[0] : bytes[1]) == 0x8B) {
+			ctx->input = PARSE_INPUT_GZIP;
+			// 16 + MAX_WBITS: gzip header and trailer, not zlib.
+			ctx->inflate = parse_inflate_new(&ctx->inflater, 16 + MAX_WBITS);
+		}
+#endif
+
+		if(ctx->num_magic) {
+			ctx->num_magic = 0;
+			parse_detect(ctx, &ctx->magic, 1);
+		}
+	}
+
+#if defined(HAVE_ZLIB_H)
+	if(ctx->inflate) {
+		parse_inflate(ctx, ctx->inflate, data, size, parse_bytes);
+		return;
+	}
+#endif
+
+	parse_bytes(ctx, data, size);
+}
+
+/*
+ * Decodes the next bytes of the input: what parse_detect takes, or a
+ * deflated ZIP entry of it.
+ */
+static void parse_input(struct parse_context *ctx, const void *data, FIT_UINT32 size) {
+#if defined(HAVE_ZLIB_H)
+	if(ctx->unzip) {
+		parse_inflate(ctx, ctx->unzip, data, size, parse_detect);
+		return;
+	}
+#endif
+
+	parse_detect(ctx, data, size);
+}
+
+/*
+ * Decodes what parse_input held back at the end of the input.
+ */
+static void parse_input_end(struct parse_context *ctx) {
+	if(ctx->num_magic) {
+		ctx->input = PARSE_INPUT_FIT;
+		ctx->num_magic = 0;
+		parse_bytes(ctx, &ctx->magic, 1);
+	}
+}
+
+/*
+ * Passes on the last records and reports how the file ended.
+ */
+static void parse_end(struct parse_context *ctx) {
+	char err_msg[128];
+
+	pass_records(ctx->handler, &ctx->records);
+
+	if (ctx->convert_return == FIT_CONVERT_ERROR) {
+		sprintf(err_msg, "Error decoding file.\n");
+		parse_err_message(ctx, err_msg);
+		return;
+	}
+
+	if (ctx->convert_return == FIT_CONVERT_CONTINUE) {
+		sprintf(err_msg, "Unexpected end of file.\n");
+		parse_err_message(ctx, err_msg);
+		return;
+	}
+
+	if (ctx->convert_return == FIT_CONVERT_PROTOCOL_VERSION_NOT_SUPPORTED) {
+		sprintf(err_msg, "Protocol version not supported.\n");
+		parse_err_message(ctx, err_msg);
+		return;
+	}
+
+	if (ctx->convert_return == FIT_CONVERT_DATA_TYPE_NOT_SUPPORTED) {
+		sprintf(err_msg, "Data type not supported.\n");
+		parse_err_message(ctx, err_msg);
+		return;
+	}
 
-void pass_message(VALUE handler, char *msg) {
-	rb_funcall(handler, rb_intern("print_msg"), 1, rb_str_new2(msg));
+	if (ctx->convert_return == FIT_CONVERT_END_OF_FILE) {
+		sprintf(err_msg, "File converted successfully.\n");
+		parse_message(ctx, err_msg);
+	}
 }
 
-void pass_err_message(VALUE handler, char *msg) {
-	rb_funcall(handler, rb_intern("print_error_msg"), 1, rb_str_new2(msg));
+/*
+ * Decodes the whole input from memory, in pieces the decoder can take.
+ */
+static void parse_range(struct parse_context *ctx, const char *data, size_t size) {
+	while(size > 0 && ctx->convert_return == FIT_CONVERT_CONTINUE) {
+		FIT_UINT32 bytes = size > FIT_UINT32_INVALID ? FIT_UINT32_INVALID : (FIT_UINT32) size;
+
+		parse_input(ctx, data, bytes);
+		data += bytes;
+		size -= bytes;
+	}
+
+	parse_input_end(ctx);
 }
 
-static VALUE fit_pos_to_rb(FIT_SINT32 pos) {
-	float tmp = pos * (180.0 / pow(2,31));
-	tmp -= (tmp > 180.0 ? 360.0 : 0.0);
-	return rb_float_new(tmp);
+/*
+ * Parses a whole file in memory, which must not change or go away until
+ * this returns.
+ */
+static void parse_memory(VALUE self, const char *data, size_t size, enum parse_mode mode, struct record_column_buffers *columns) {
+	struct parse_context ctx;
+	VALUE messages;
+	char err_msg[128];
+
+	parse_begin(&ctx, self, mode, columns);
+
+	if(size == 0) {
+		sprintf(err_msg, "Passed in string with length of 0!\n");
+		parse_err_message(&ctx, err_msg);
+		return;
+	}
+
+	ctx.messages = ALLOCV_N(struct decoded_message, messages, DECODE_CHUNK_MESSAGES);
+	parse_range(&ctx, data, size);
+	ALLOCV_END(messages);
+
+	parse_end(&ctx);
 }
 
+static void parse_data(VALUE self, VALUE str, enum parse_mode mode, struct record_column_buffers *columns) {
+	// str must be a frozen copy (callers make one with rb_str_new_frozen), so
+	// other threads and callbacks can't change the data under the decoder.
+	parse_memory(self, RSTRING_PTR(str), RSTRING_LEN(str), mode, columns);
+	RB_GC_GUARD(str);
+}
 
-static VALUE init(VALUE self, VALUE handler) {
-	rb_ivar_set(self, rb_intern("@handler"), handler);
+/*
+ * RecordColumns::TYPES, the pack directive of each column by field name.
+ */
+static VALUE record_column_types(void) {
+	VALUE types = rb_hash_new();
+	size_t i;
 
-	return Qnil;
+	for(i = 0; i < RECORD_COLUMNS; i++) {
+		VALUE key = message_keys[KEYS_SYMBOL][MESSAGE_RECORD][record_columns[i].field_num];
+		rb_hash_aset(types, key, rb_str_freeze(rb_str_new(&record_columns[i].type, 1)));
+	}
+
+	return rb_hash_freeze(types);
 }
 
-static void pass_activity(VALUE handler, const FIT_ACTIVITY_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->total_timer_time != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_timer_time"), rb_float_new(mesg->total_timer_time / 1000.0));
-	if(mesg->local_timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("local_timestamp"), rb_float_new(mesg->local_timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->num_sessions != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("num_sessions"), UINT2NUM(mesg->num_sessions));
-	if(mesg->type != FIT_ENUM_INVALID)
-		rb_hash_aset(rh, rb_str_new2("type"), CHR2FIX(mesg->type));
-	if(mesg->event != FIT_ENUM_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event"), CHR2FIX(mesg->event));
-	if(mesg->event_type != FIT_ENUM_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_type"), CHR2FIX(mesg->event_type));
-	if(mesg->event_group != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_group"), UINT2NUM(mesg->event_group));
-
-	rb_funcall(handler, rb_intern("on_activity"), 1, rh);
-}
-
-static void pass_record(VALUE handler, const FIT_RECORD_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->position_lat != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("position_lat"), fit_pos_to_rb(mesg->position_lat));
-	if(mesg->position_long != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("position_long"), fit_pos_to_rb(mesg->position_long));
-	if(mesg->distance != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("distance"), rb_float_new(mesg->distance / 100.0));
-	if(mesg->time_from_course != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("time_from_course"), rb_float_new(mesg->time_from_course / 1000.0));
-	if(mesg->heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("heart_rate"), UINT2NUM(mesg->heart_rate));
-	if(mesg->altitude != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("altitude"), rb_float_new(mesg->altitude / 5.0 - 500));
-	if(mesg->enhanced_altitude != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_altitude"), rb_float_new(mesg->enhanced_altitude / 5.0 - 500));
-	if(mesg->speed != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("speed"), rb_float_new(mesg->speed / 1000.0));
-	if(mesg->enhanced_speed != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_speed"), rb_float_new(mesg->enhanced_speed / 1000.0));
-	if(mesg->grade != FIT_SINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("grade"), rb_float_new(mesg->grade / 100.0));
-	if(mesg->power != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("power"), UINT2NUM(mesg->power));
-	if(mesg->cadence != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("cadence"), UINT2NUM(mesg->cadence));
-	if(mesg->resistance != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("resistance"), UINT2NUM(mesg->resistance));
-	if(mesg->cycle_length != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("cycle_length"), UINT2NUM(mesg->cycle_length));
-	if(mesg->temperature != FIT_SINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("temperature"), INT2FIX(mesg->temperature));
-
-	if(mesg->left_right_balance != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("left_right_balance"), UINT2NUM(mesg->left_right_balance & FIT_LEFT_RIGHT_BALANCE_MASK));
-	if(mesg->left_torque_effectiveness != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("left_torque_effectiveness"), UINT2NUM(mesg->left_torque_effectiveness));
-	if(mesg->right_torque_effectiveness != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("right_torque_effectiveness"), UINT2NUM(mesg->right_torque_effectiveness));
-	if(mesg->left_pedal_smoothness != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("left_pedal_smoothness"), UINT2NUM(mesg->left_pedal_smoothness));
-	if(mesg->right_pedal_smoothness != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("right_pedal_smoothness"), UINT2NUM(mesg->right_pedal_smoothness));
-	if(mesg->combined_pedal_smoothness != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("combined_pedal_smoothness"), UINT2NUM(mesg->combined_pedal_smoothness));
-
-	rb_funcall(handler, rb_intern("on_record"), 1, rh);
-}
-
-static void pass_lap(VALUE handler, const FIT_LAP_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->start_time != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("start_time"), UINT2NUM(mesg->start_time + GARMIN_TIME_OFFSET));
-	if(mesg->start_position_lat != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("start_position_lat"), fit_pos_to_rb(mesg->start_position_lat));
-	if(mesg->start_position_long != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("start_position_long"), fit_pos_to_rb(mesg->start_position_long));
-	if(mesg->end_position_lat != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("end_position_lat"), fit_pos_to_rb(mesg->end_position_lat));
-	if(mesg->end_position_long != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("end_position_long"), fit_pos_to_rb(mesg->end_position_long));
-	if(mesg->total_elapsed_time != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_elapsed_time"), UINT2NUM(mesg->total_elapsed_time));
-	if(mesg->total_timer_time != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_timer_time"), rb_float_new(mesg->total_timer_time / 1000.0));
-	if(mesg->total_distance != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_distance"), rb_float_new(mesg->total_distance / 100.0));
-	if(mesg->total_cycles != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_cycles"), UINT2NUM(mesg->total_cycles));
-	if(mesg->message_index != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("message_index"), UINT2NUM(mesg->message_index));
-	if(mesg->total_calories != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_calories"), UINT2NUM(mesg->total_calories));
-	if(mesg->total_fat_calories != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_fat_calories"), UINT2NUM(mesg->total_fat_calories));
-	if(mesg->avg_speed != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_speed"), rb_float_new(mesg->avg_speed / 1000.0));
-	if(mesg->max_speed != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_speed"), rb_float_new(mesg->max_speed / 1000.0));
-	if(mesg->enhanced_avg_speed != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_avg_speed"), rb_float_new(mesg->enhanced_avg_speed / 1000.0));
-	if(mesg->enhanced_max_speed != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_max_speed"), rb_float_new(mesg->enhanced_max_speed / 1000.0));
-	if(mesg->avg_altitude != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_altitude"), rb_float_new(mesg->avg_altitude / 5.0 - 500));
-	if(mesg->max_altitude != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_altitude"), rb_float_new(mesg->max_altitude / 5.0 - 500));
-	if(mesg->min_altitude != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("min_altitude"), rb_float_new(mesg->min_altitude / 5.0 - 500));
-	if(mesg->enhanced_avg_altitude != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_avg_altitude"), rb_float_new(mesg->enhanced_avg_altitude / 5.0 - 500));
-	if(mesg->enhanced_max_altitude != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_max_altitude"), rb_float_new(mesg->enhanced_max_altitude / 5.0 - 500));
-	if(mesg->enhanced_min_altitude != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("enhanced_min_altitude"), rb_float_new(mesg->enhanced_min_altitude / 5.0 - 500));
-	if(mesg->avg_power != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_power"), UINT2NUM(mesg->avg_power));
-	if(mesg->max_power != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_power"), UINT2NUM(mesg->max_power));
-	if(mesg->total_ascent != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_ascent"), UINT2NUM(mesg->total_ascent));
-	if(mesg->total_descent != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_descent"), UINT2NUM(mesg->total_descent));
-	if(mesg->event != FIT_EVENT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event"), CHR2FIX(mesg->event));
-	if(mesg->event_type != FIT_EVENT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_type"), CHR2FIX(mesg->event_type));
-	if(mesg->avg_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_heart_rate"), UINT2NUM(mesg->avg_heart_rate));
-	if(mesg->max_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_heart_rate"), UINT2NUM(mesg->max_heart_rate));
-	if(mesg->avg_cadence != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_cadence"), UINT2NUM(mesg->avg_cadence));
-	if(mesg->max_cadence != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_cadence"), UINT2NUM(mesg->max_cadence));
-	if(mesg->intensity != FIT_INTENSITY_INVALID)
-		rb_hash_aset(rh, rb_str_new2("intensity"), CHR2FIX(mesg->intensity));
-        if(mesg->lap_trigger != FIT_LAP_TRIGGER_INVALID)
-		rb_hash_aset(rh, rb_str_new2("lap_trigger"), CHR2FIX(mesg->lap_trigger));
-        if(mesg->sport != FIT_SPORT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("sport"), CHR2FIX(mesg->sport));
-        if(mesg->event_group != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_group"), UINT2NUM(mesg->event_group));
-
-	rb_funcall(handler, rb_intern("on_lap"), 1, rh);
-}
-
-static void pass_session(VALUE handler, const FIT_SESSION_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->start_time != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("start_time"), UINT2NUM(mesg->start_time + GARMIN_TIME_OFFSET));
-	if(mesg->start_position_lat != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("start_position_lat"), fit_pos_to_rb(mesg->start_position_lat));
-	if(mesg->start_position_long != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("start_position_long"), fit_pos_to_rb(mesg->start_position_long));
-	if(mesg->total_elapsed_time != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_elapsed_time"), rb_float_new(mesg->total_elapsed_time / 1000.0));
-	if(mesg->total_timer_time != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_timer_time"), rb_float_new(mesg->total_timer_time / 1000.0));
-	if(mesg->total_distance != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_distance"), rb_float_new(mesg->total_distance / 100.0));
-	if(mesg->total_cycles != FIT_UINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_cycles"), UINT2NUM(mesg->total_cycles));
-	if(mesg->nec_lat != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("nec_lat"), fit_pos_to_rb(mesg->nec_lat));
-	if(mesg->nec_long != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("nec_long"), fit_pos_to_rb(mesg->nec_long));
-	if(mesg->swc_lat != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("swc_lat"), fit_pos_to_rb(mesg->swc_lat));
-	if(mesg->swc_long != FIT_SINT32_INVALID)
-		rb_hash_aset(rh, rb_str_new2("swc_long"), fit_pos_to_rb(mesg->swc_long));
-	if(mesg->message_index != FIT_MESSAGE_INDEX_INVALID)
-		rb_hash_aset(rh, rb_str_new2("message_index"), UINT2NUM(mesg->message_index));
-	if(mesg->total_calories != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_calories"), UINT2NUM(mesg->total_calories));
-	if(mesg->total_fat_calories != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_fat_calories"), UINT2NUM(mesg->total_fat_calories));
-	if(mesg->avg_speed != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_speed"), rb_float_new(mesg->avg_speed / 1000.0));
-	if(mesg->max_speed != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_speed"), rb_float_new(mesg->max_speed / 1000.0));
-	if(mesg->avg_power != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_power"), UINT2NUM(mesg->avg_power));
-	if(mesg->max_power != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_power"), UINT2NUM(mesg->max_power));
-	if(mesg->total_ascent != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_ascent"), UINT2NUM(mesg->total_ascent));
-	if(mesg->total_descent != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_descent"), UINT2NUM(mesg->total_descent));
-	if(mesg->first_lap_index != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("first_lap_index"), UINT2NUM(mesg->first_lap_index));
-	if(mesg->num_laps != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("num_laps"), UINT2NUM(mesg->num_laps));
-	if(mesg->event != FIT_EVENT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event"), CHR2FIX(mesg->event));
-	if(mesg->event_type != FIT_EVENT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_type"), CHR2FIX(mesg->event_type));
-	if(mesg->avg_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_heart_rate"), UINT2NUM(mesg->avg_heart_rate));
-	if(mesg->max_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_heart_rate"), UINT2NUM(mesg->max_heart_rate));
-	if(mesg->avg_cadence != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("avg_cadence"), UINT2NUM(mesg->avg_cadence));
-	if(mesg->max_cadence != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("max_cadence"), UINT2NUM(mesg->max_cadence));
-	if(mesg->sport != FIT_SPORT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("sport"), CHR2FIX(mesg->sport));
-	if(mesg->sub_sport != FIT_SUB_SPORT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("sub_sport"), CHR2FIX(mesg->sub_sport));
-	if(mesg->event_group != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_group"), UINT2NUM(mesg->event_group));
-	if(mesg->total_training_effect != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("total_training_effect"), UINT2NUM(mesg->total_training_effect));
-
-	rb_funcall(handler, rb_intern("on_session"), 1, rh);
-}
-
-static void pass_user_profile(VALUE handler, const FIT_USER_PROFILE_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-        if(*mesg->friendly_name != FIT_STRING_INVALID)
-	        rb_hash_aset(rh, rb_str_new2("friendly_name"), rb_str_new2(mesg->friendly_name));
-	if(mesg->message_index != FIT_MESSAGE_INDEX_INVALID)
-		rb_hash_aset(rh, rb_str_new2("message_index"), UINT2NUM(mesg->message_index));
-	if(mesg->weight != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("weight"), rb_float_new(mesg->weight / 10.0));
-	if(mesg->gender != FIT_GENDER_INVALID)
-		rb_hash_aset(rh, rb_str_new2("gender"), UINT2NUM(mesg->gender));
-	if(mesg->age != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("age"), UINT2NUM(mesg->age));
-	if(mesg->height != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("height"), rb_float_new(mesg->height / 100.0));
-	if(mesg->language != FIT_LANGUAGE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("language"), UINT2NUM(mesg->language));
-	if(mesg->elev_setting != FIT_DISPLAY_MEASURE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("elev_setting"), UINT2NUM(mesg->elev_setting));
-	if(mesg->weight_setting != FIT_DISPLAY_MEASURE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("weight_setting"), UINT2NUM(mesg->weight_setting));
-	if(mesg->resting_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("resting_heart_rate"), UINT2NUM(mesg->resting_heart_rate));
-	if(mesg->default_max_running_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("default_max_running_heart_rate"), UINT2NUM(mesg->default_max_running_heart_rate));
-	if(mesg->default_max_biking_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("default_max_biking_heart_rate"), UINT2NUM(mesg->default_max_biking_heart_rate));
-	if(mesg->default_max_heart_rate != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("default_max_heart_rate"), UINT2NUM(mesg->default_max_heart_rate));
-	if(mesg->hr_setting != FIT_DISPLAY_HEART_INVALID)
-		rb_hash_aset(rh, rb_str_new2("hr_setting"), UINT2NUM(mesg->hr_setting));
-	if(mesg->speed_setting != FIT_DISPLAY_MEASURE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("speed_setting"), UINT2NUM(mesg->speed_setting));
-	if(mesg->dist_setting != FIT_DISPLAY_MEASURE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("dist_setting"), UINT2NUM(mesg->dist_setting));
-	if(mesg->power_setting != FIT_DISPLAY_POWER_INVALID)
-		rb_hash_aset(rh, rb_str_new2("power_setting"), UINT2NUM(mesg->power_setting));
-	if(mesg->activity_class != FIT_ACTIVITY_CLASS_INVALID)
-		rb_hash_aset(rh, rb_str_new2("activity_class"), UINT2NUM(mesg->activity_class));
-	if(mesg->position_setting != FIT_DISPLAY_POSITION_INVALID)
-		rb_hash_aset(rh, rb_str_new2("position_setting"), UINT2NUM(mesg->position_setting));
-
-	rb_funcall(handler, rb_intern("on_user_profile"), 1, rh);
-}
-
-static void pass_event(VALUE handler, const FIT_EVENT_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->data != FIT_UINT32_INVALID)
-                rb_hash_aset(rh, rb_str_new2("data"), UINT2NUM(mesg->data));
-	if(mesg->data16 != FIT_UINT16_INVALID)
-                rb_hash_aset(rh, rb_str_new2("data16"), UINT2NUM(mesg->data16));
-	if(mesg->timestamp != FIT_EVENT_INVALID)
-                rb_hash_aset(rh, rb_str_new2("event"), CHR2FIX(mesg->event));
-	if(mesg->timestamp != FIT_EVENT_TYPE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("event_type"), CHR2FIX(mesg->event_type));
-	if(mesg->event_group != FIT_UINT8_INVALID)
-	        rb_hash_aset(rh, rb_str_new2("event_group"), UINT2NUM(mesg->event_group));
-
-	rb_funcall(handler, rb_intern("on_event"), 1, rh);
-}
-
-static void pass_device_info(VALUE handler, const FIT_DEVICE_INFO_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->serial_number != FIT_UINT32Z_INVALID)
-		rb_hash_aset(rh, rb_str_new2("serial_number"), UINT2NUM(mesg->serial_number));
-	if(mesg->manufacturer != FIT_MANUFACTURER_INVALID)
-		rb_hash_aset(rh, rb_str_new2("manufacturer"), UINT2NUM(mesg->manufacturer));
-	if(mesg->product != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("product"), UINT2NUM(mesg->product));
-	if(mesg->software_version != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("software_version"), UINT2NUM(mesg->software_version));
-	if(mesg->battery_voltage != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("battery_voltage"), UINT2NUM(mesg->battery_voltage));
-	if(mesg->device_index != FIT_DEVICE_INDEX_INVALID)
-		rb_hash_aset(rh, rb_str_new2("device_index"), UINT2NUM(mesg->device_index));
-	if(mesg->device_type != FIT_ANTPLUS_DEVICE_TYPE_INVALID)
-		rb_hash_aset(rh, rb_str_new2("device_type"), UINT2NUM(mesg->device_type));
-	if(mesg->hardware_version != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("hardware_version"), UINT2NUM(mesg->hardware_version));
-	if(mesg->battery_status != FIT_BATTERY_STATUS_INVALID)
-		rb_hash_aset(rh, rb_str_new2("battery_status"), UINT2NUM(mesg->battery_status));
-
-	rb_funcall(handler, rb_intern("on_device_info"), 1, rh);
-}
-
-static void pass_weight_scale_info(VALUE handler, const FIT_WEIGHT_SCALE_MESG *mesg) {
-	VALUE rh = rb_hash_new();
-
-	if(mesg->timestamp != FIT_DATE_TIME_INVALID)
-		rb_hash_aset(rh, rb_str_new2("timestamp"), UINT2NUM(mesg->timestamp + GARMIN_TIME_OFFSET));
-	if(mesg->weight != FIT_WEIGHT_INVALID)
-		rb_hash_aset(rh, rb_str_new2("weight"), rb_float_new(mesg->weight / 100.0));
-	if(mesg->percent_fat != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("percent_fat"), rb_float_new(mesg->percent_fat / 100.0));
-	if(mesg->percent_hydration != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("percent_hydration"), rb_float_new(mesg->percent_hydration / 100.0));
-	if(mesg->visceral_fat_mass != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("visceral_fat_mass"), rb_float_new(mesg->visceral_fat_mass / 100.0));
-	if(mesg->bone_mass != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("bone_mass"), rb_float_new(mesg->bone_mass / 100.0));
-	if(mesg->muscle_mass != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("muscle_mass"), rb_float_new(mesg->muscle_mass / 100.0));
-	if(mesg->basal_met != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("basal_met"), rb_float_new(mesg->basal_met / 4.0));
-	if(mesg->active_met != FIT_UINT16_INVALID)
-		rb_hash_aset(rh, rb_str_new2("active_met"), rb_float_new(mesg->active_met / 4.0));
-	if(mesg->physique_rating != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("physique_rating"), rb_float_new(mesg->physique_rating));
-	if(mesg->metabolic_age != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("metabolic_age"), rb_float_new(mesg->metabolic_age));
-	if(mesg->visceral_fat_rating != FIT_UINT8_INVALID)
-		rb_hash_aset(rh, rb_str_new2("visceral_fat_rating"), rb_float_new(mesg->visceral_fat_rating));
-
-	rb_funcall(handler, rb_intern("on_weight_scale_info"), 1, rh);
+#if defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING)
+struct parse_buffer_args {
+	VALUE self;
+	VALUE buffer;
+};
+
+static VALUE parse_buffer(VALUE arg) {
+	struct parse_buffer_args *args = (struct parse_buffer_args *) arg;
+	const void *data;
+	size_t size;
+
+	rb_io_buffer_get_bytes_for_reading(args->buffer, &data, &size);
+	parse_memory(args->self, data, size, PARSE_HANDLER, NULL);
+	return Qnil;
 }
+#endif
 
+/*
+ * FitParser#parse(data)
+ *
+ * Parses a whole file, passing each message to the handler.  data is a
+ * String, or an IO::Buffer, which is parsed in place without being copied;
+ * it is locked while parsing, and must not be written to.
+ */
 static VALUE parse(VALUE self, VALUE original_str) {
-	int i = 0;
-	VALUE str = StringValue(original_str);
-	VALUE handler = rb_ivar_get(self, rb_intern("@handler"));
-	char *p = RSTRING_PTR(str);
-	char err_msg[128];
-
-	FIT_UINT8 buf[8];
-	FIT_CONVERT_RETURN convert_return = FIT_CONVERT_CONTINUE;
-	FIT_UINT32 buf_size;
-	FIT_CONVERT_STATE state;
-	FitConvert_Init(&state, FIT_TRUE);
+#if defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING)
+	if(rb_obj_is_kind_of(original_str, rb_cIOBuffer)) {
+		struct parse_buffer_args args;
 
-	if(RSTRING_LEN(str) == 0) {
-		//sprintf(err_msg, "Passed in string with length of 0!");
-		pass_err_message(handler, err_msg);
+		args.self = self;
+		args.buffer = original_str;
+		rb_io_buffer_lock(args.buffer);
+		rb_ensure(parse_buffer, (VALUE) &args, rb_io_buffer_unlock, args.buffer);
 		return Qnil;
 	}
+#endif
+
+	parse_data(self, rb_str_new_frozen(StringValue(original_str)), PARSE_HANDLER, NULL);
+	return Qnil;
+}
+
+static void parse_file_data(VALUE self, const char *data, size_t size) {
+	parse_memory(self, data, size, PARSE_HANDLER, NULL);
+}
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+struct parse_file_args {
+	VALUE self;
+	VALUE path;
+	int fd;
+	char *data;
+	size_t size;
+	void (*parse)(VALUE self, const char *data, size_t size);
+};
+
+static VALUE parse_file_mapped(VALUE arg) {
+	struct parse_file_args *args = (struct parse_file_args *) arg;
+	struct stat st;
+
+	if(fstat(args->fd, &st) < 0)
+		rb_sys_fail_str(args->path);
+
+	if(st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, args->fd, 0);
+
+		if(data == MAP_FAILED)
+			rb_sys_fail_str(args->path);
+
+		args->data = data;
+		args->size = st.st_size;
+#if defined(HAVE_MADVISE)
+		madvise(args->data, args->size, MADV_SEQUENTIAL);
+#endif
+	}
+
+	args->parse(args->self, args->data, args->size);
+	return Qnil;
+}
+
+static VALUE parse_file_unmap(VALUE arg) {
+	struct parse_file_args *args = (struct parse_file_args *) arg;
+
+	if(args->data)
+		munmap(args->data, args->size);
+	close(args->fd);
+	return Qnil;
+}
+#endif
+
+/*
+ * Passes a read-only memory mapping of the file at path to parse, or the
+ * file read into a String without mmap.
+ */
+static void map_file(VALUE self, VALUE path, void (*parse)(VALUE self, const char *data, size_t size)) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+	struct parse_file_args args;
+
+	FilePathValue(path);
+
+	args.self = self;
+	args.path = path;
+	args.data = NULL;
+	args.size = 0;
+	args.parse = parse;
+	args.fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0);
+	if(args.fd < 0)
+		rb_sys_fail_str(path);
+	rb_update_max_fd(args.fd);
+
+	rb_ensure(parse_file_mapped, (VALUE) &args, parse_file_unmap, (VALUE) &args);
+#else
+	VALUE str = rb_funcall(rb_cFile, rb_intern("binread"), 1, path);
+
+	parse(self, RSTRING_PTR(str), RSTRING_LEN(str));
+	RB_GC_GUARD(str);
+#endif
+}
+
+/*
+ * FitParser#parse_file(path)
+ *
+ * Parses the file at path like parse, but decodes straight from a read-only
+ * memory mapping of it rather than from a String.  The file must not be
+ * truncated while it is parsed.
+ */
+static VALUE parse_file(VALUE self, VALUE path) {
+	map_file(self, path, parse_file_data);
+	return Qnil;
+}
+
+/*
+ * ZIP archives, as in APPNOTE.TXT: the end of central directory record
+ * (zip64 too) points at the central directory, whose entries point at the
+ * local header in front of each file's data.
+ */
+#define ZIP_EOCD_SIGNATURE 0x06054B50
+#define ZIP_EOCD_SIZE 22
+#define ZIP64_EOCD_LOCATOR_SIGNATURE 0x07064B50
+#define ZIP64_EOCD_LOCATOR_SIZE 20
+#define ZIP64_EOCD_SIGNATURE 0x06064B50
+#define ZIP64_EOCD_SIZE 56
+#define ZIP_CENTRAL_SIGNATURE 0x02014B50
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_LOCAL_SIGNATURE 0x04034B50
+#define ZIP_LOCAL_SIZE 30
+#define ZIP64_EXTRA_ID 0x0001
+
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_UTF8 0x0800
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+static FIT_UINT16 zip_u16(const FIT_UINT8 *p) {
+	return (FIT_UINT16) (p[0] | p[1] << 8);
+}
+
+static FIT_UINT32 zip_u32(const FIT_UINT8 *p) {
+	return (FIT_UINT32) zip_u16(p) | (FIT_UINT32) zip_u16(p + 2) << 16;
+}
+
+static FIT_UINT64 zip_u64(const FIT_UINT8 *p) {
+	return (FIT_UINT64) zip_u32(p) | (FIT_UINT64) zip_u32(p + 4) << 32;
+}
+
+NORETURN(static void zip_invalid(void));
+
+static void zip_invalid(void) {
+	rb_raise(eParseError, "Invalid ZIP archive");
+}
+
+/*
+ * FIT files, compressed or not, leaving out macOS resource forks.
+ */
+static int zip_entry_is_fit(const char *name, size_t length) {
+	static const char *const extensions[] = { ".fit", ".fit.gz" };
+	size_t i;
+
+	if(length >= 9 && memcmp(name, "__MACOSX/", 9) == 0)
+		return 0;
+
+	for(i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+		size_t extension_length = strlen(extensions[i]);
+
+		if(length > extension_length && STRNCASECMP(name + length - extension_length, extensions[i], extension_length) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void parse_zip_entry(struct parse_context *ctx, FIT_UINT16 flags, FIT_UINT16 method, const char *data, size_t size) {
+	if(flags & ZIP_FLAG_ENCRYPTED) {
+		parse_err_message(ctx, "Encrypted file.\n");
+		return;
+	}
+
+	if(method == ZIP_METHOD_DEFLATED) {
+#if defined(HAVE_ZLIB_H)
+		ctx->unzip = parse_inflate_new(&ctx->unzipper, -MAX_WBITS);
+#else
+		parse_err_message(ctx, "Compression method not supported.\n");
+		return;
+#endif
+	} else if(method != ZIP_METHOD_STORED) {
+		parse_err_message(ctx, "Compression method not supported.\n");
+		return;
+	}
+
+	parse_range(ctx, data, size);
+	parse_end(ctx);
+}
+
+static void parse_zip_data(VALUE self, const char *data, size_t size) {
+	const FIT_UINT8 *zip = (const FIT_UINT8 *) data;
+	const FIT_UINT8 *eocd = NULL;
+	FIT_UINT64 entries, central_size, central_offset, entry, offset;
+	struct parse_context ctx;
+	struct decoded_message *buffer;
+	VALUE messages;
+	size_t i;
 
-	while(i < RSTRING_LEN(str) && (convert_return == FIT_CONVERT_CONTINUE)) {
-		for(buf_size=0;(buf_size < sizeof(buf)) && (p != NULL); buf_size++) {
-			buf[buf_size] = *p;
-			p++;
-			i++;
+	// The end of central directory record is followed by at most a 64 KB
+	// comment.
+	for(i = size >= ZIP_EOCD_SIZE ? size - ZIP_EOCD_SIZE + 1 : 0; i > 0 && size - i < ZIP_EOCD_SIZE + 0xFFFF; i--) {
+		if(zip_u32(zip + i - 1) == ZIP_EOCD_SIGNATURE) {
+			eocd = zip + i - 1;
+			break;
 		}
+	}
+
+	if(!eocd)
+		zip_invalid();
 
-		do {
-			convert_return = FitConvert_Read(&state, buf, buf_size);
-
-			switch(convert_return) {
-				case FIT_CONVERT_MESSAGE_AVAILABLE: {
-					const FIT_UINT8 *mesg = FitConvert_GetMessageData(&state);
-					FIT_UINT16 mesg_num = FitConvert_GetMessageNumber(&state);
-
-					switch(mesg_num) {
-						case FIT_MESG_NUM_FILE_ID: {
-							break;
-						}
-
-						case FIT_MESG_NUM_USER_PROFILE: {
-							const FIT_USER_PROFILE_MESG *user_profile = (FIT_USER_PROFILE_MESG *) mesg;
-							pass_user_profile(handler, user_profile);
-							break;
-						}
-
-						case FIT_MESG_NUM_ACTIVITY: {
-							const FIT_ACTIVITY_MESG *activity = (FIT_ACTIVITY_MESG *) mesg;
-							pass_activity(handler, activity);
-
-							{
-								FIT_ACTIVITY_MESG old_mesg;
-								old_mesg.num_sessions = 1;
-								FitConvert_RestoreFields(&state, &old_mesg);
-								sprintf(err_msg, "Restored num_sessions=1 - Activity: timestamp=%u, type=%u, event=%u, event_type=%u, num_sessions=%u\n", activity->timestamp, activity->type, activity->event, activity->event_type, activity->num_sessions);
-								pass_message(handler, err_msg);
-							}
-							break;
-						}
-
-						case FIT_MESG_NUM_SESSION: {
-							const FIT_SESSION_MESG *session = (FIT_SESSION_MESG *) mesg;
-							pass_session(handler, session);
-							break;
-						}
-
-						case FIT_MESG_NUM_LAP: {
-							const FIT_LAP_MESG *lap = (FIT_LAP_MESG *) mesg;
-							pass_lap(handler, lap);
-							break;
-						}
-
-						case FIT_MESG_NUM_RECORD: {
-							const FIT_RECORD_MESG *record = (FIT_RECORD_MESG *) mesg;
-							pass_record(handler, record);
-							break;
-						}
-
-						case FIT_MESG_NUM_EVENT: {
-							const FIT_EVENT_MESG *event = (FIT_EVENT_MESG *) mesg;
-							pass_event(handler, event);
-							break;
-						}
-
-						case FIT_MESG_NUM_DEVICE_INFO: {
-							const FIT_DEVICE_INFO_MESG *device_info = (FIT_DEVICE_INFO_MESG *) mesg;
-							pass_device_info(handler, device_info);
-							break;
-						}
-
-						case FIT_MESG_NUM_WEIGHT_SCALE: {
-							const FIT_WEIGHT_SCALE_MESG *weight_scale_info = (FIT_WEIGHT_SCALE_MESG *) mesg;
-							pass_weight_scale_info(handler, weight_scale_info);
-							break;
-						}
-
-						default: {
-							sprintf(err_msg, "Unknown message\n");
-							pass_message(handler, err_msg);
-							break;
-						}
+	entries = zip_u16(eocd + 10);
+	central_size = zip_u32(eocd + 12);
+	central_offset = zip_u32(eocd + 16);
+
+	if(eocd - zip >= ZIP64_EOCD_LOCATOR_SIZE && zip_u32(eocd - ZIP64_EOCD_LOCATOR_SIZE) == ZIP64_EOCD_LOCATOR_SIGNATURE) {
+		const FIT_UINT8 *eocd64;
+		FIT_UINT64 eocd64_offset = zip_u64(eocd - ZIP64_EOCD_LOCATOR_SIZE + 8);
+
+		if(size < ZIP64_EOCD_SIZE || eocd64_offset > size - ZIP64_EOCD_SIZE || zip_u32(zip + eocd64_offset) != ZIP64_EOCD_SIGNATURE)
+			zip_invalid();
+
+		eocd64 = zip + eocd64_offset;
+		entries = zip_u64(eocd64 + 32);
+		central_size = zip_u64(eocd64 + 40);
+		central_offset = zip_u64(eocd64 + 48);
+	}
+
+	if(central_offset > size || central_size > size - central_offset)
+		zip_invalid();
+
+	buffer = ALLOCV_N(struct decoded_message, messages, DECODE_CHUNK_MESSAGES);
+
+	for(entry = 0, offset = central_offset; entry < entries; entry++) {
+		const FIT_UINT8 *header = zip + offset;
+		const char *name;
+		FIT_UINT16 flags, method, name_length, extra_length;
+		FIT_UINT64 compressed_size, local_offset, data_offset;
+
+		if(central_offset + central_size - offset < ZIP_CENTRAL_SIZE || zip_u32(header) != ZIP_CENTRAL_SIGNATURE)
+			zip_invalid();
+
+		flags = zip_u16(header + 8);
+		method = zip_u16(header + 10);
+		compressed_size = zip_u32(header + 20);
+		name_length = zip_u16(header + 28);
+		extra_length = zip_u16(header + 30);
+		local_offset = zip_u32(header + 42);
+		name = (const char *) header + ZIP_CENTRAL_SIZE;
+
+		offset += ZIP_CENTRAL_SIZE + name_length + extra_length + zip_u16(header + 32);
+		if(offset > central_offset + central_size)
+			zip_invalid();
+
+		// Sizes and offsets that don't fit 32 bits are in the zip64 extra
+		// field, in this order, if they are 0xFFFFFFFF.
+		if(compressed_size == 0xFFFFFFFF || local_offset == 0xFFFFFFFF) {
+			const FIT_UINT8 *extra = header + ZIP_CENTRAL_SIZE + name_length;
+			const FIT_UINT8 *extra_end = extra + extra_length;
+
+			while(extra_end - extra >= 4) {
+				FIT_UINT16 extra_size = zip_u16(extra + 2);
+				const FIT_UINT8 *value = extra + 4;
+
+				if(extra_end - value < extra_size)
+					zip_invalid();
+
+				if(zip_u16(extra) == ZIP64_EXTRA_ID) {
+					const FIT_UINT8 *value_end = value + extra_size;
+
+					if(zip_u32(header + 24) == 0xFFFFFFFF)
+						value += 8;
+					if(compressed_size == 0xFFFFFFFF && value_end - value >= 8) {
+						compressed_size = zip_u64(value);
+						value += 8;
 					}
+					if(local_offset == 0xFFFFFFFF && value_end - value >= 8)
+						local_offset = zip_u64(value);
 					break;
 				}
-				default:
-					break;
+
+				extra = value + extra_size;
 			}
-		} while (convert_return == FIT_CONVERT_MESSAGE_AVAILABLE);
-	}
+		}
 
-	if (convert_return == FIT_CONVERT_ERROR) {
-		sprintf(err_msg, "Error decoding file.\n");
-		pass_err_message(handler, err_msg);
-		return Qnil;
+		if(!zip_entry_is_fit(name, name_length))
+			continue;
+
+		if(size < ZIP_LOCAL_SIZE || local_offset > size - ZIP_LOCAL_SIZE || zip_u32(zip + local_offset) != ZIP_LOCAL_SIGNATURE)
+			zip_invalid();
+
+		data_offset = local_offset + ZIP_LOCAL_SIZE + zip_u16(zip + local_offset + 26) + zip_u16(zip + local_offset + 28);
+		if(data_offset > size || compressed_size > size - data_offset)
+			zip_invalid();
+
+		parse_begin(&ctx, self, PARSE_HANDLER, NULL);
+		ctx.messages = buffer;
+		parse_zip_entry(&ctx, flags, method, data + data_offset, compressed_size);
+
+		if(rb_block_given_p())
+			rb_yield(flags & ZIP_FLAG_UTF8 ? rb_utf8_str_new(name, name_length) : rb_str_new(name, name_length));
 	}
 
-	if (convert_return == FIT_CONVERT_CONTINUE) {
-		sprintf(err_msg, "Unexpected end of file.\n");
-		pass_err_message(handler, err_msg);
-		return Qnil;
+	ALLOCV_END(messages);
+}
+
+/*
+ * FitParser#parse_zip(path) { |name| ... }
+ *
+ * Parses each FIT file (.fit or .fit.gz) in the ZIP archive at path, in the
+ * order of its central directory, as parse_file would, and yields the name
+ * of each file once the handler has been passed all of it.  Stored and
+ * deflated files are decoded straight from the archive without being
+ * extracted.  Raises RubyFit::ParseError if the archive itself is broken.
+ */
+static VALUE parse_zip(VALUE self, VALUE path) {
+	map_file(self, path, parse_zip_data);
+	return Qnil;
+}
+
+/*
+ * The parse_context of FitParser#feed, kept between calls in @stream.
+ */
+struct parse_stream {
+	struct parse_context ctx;
+	int busy; // Set while feed or finish runs, so callbacks can't re-enter them.
+	int done; // Set when feed or finish ran to completion.
+};
+
+static void parse_stream_mark(void *ptr) {
+	struct parse_stream *stream = ptr;
+	size_t i;
+
+	rb_gc_mark(stream->ctx.handler);
+	rb_gc_mark(stream->ctx.records);
+	rb_gc_mark(stream->ctx.inflater);
+	rb_gc_mark(stream->ctx.unzipper);
+	for(i = 0; i < MESSAGES; i++)
+		rb_gc_mark(stream->ctx.reused[i]);
+}
+
+static void parse_stream_free(void *ptr) {
+	struct parse_stream *stream = ptr;
+
+	ruby_xfree(stream->ctx.messages);
+	ruby_xfree(stream);
+}
+
+static size_t parse_stream_memsize(const void *ptr) {
+	return sizeof(struct parse_stream) + sizeof(struct decoded_message) * DECODE_CHUNK_MESSAGES;
+}
+
+static const rb_data_type_t parse_stream_type = {
+	"RubyFit::FitParser::Stream",
+	{ parse_stream_mark, parse_stream_free, parse_stream_memsize, },
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE cParseStream;
+
+static struct parse_stream *parse_stream(VALUE self, int create) {
+	VALUE object = rb_ivar_get(self, rb_intern("@stream"));
+	struct parse_stream *stream;
+
+	if(NIL_P(object)) {
+		if(!create)
+			return NULL;
+
+		object = TypedData_Make_Struct(cParseStream, struct parse_stream, &parse_stream_type, stream);
+		parse_begin(&stream->ctx, self, PARSE_HANDLER, NULL);
+		stream->ctx.messages = ALLOC_N(struct decoded_message, DECODE_CHUNK_MESSAGES);
+		rb_ivar_set(self, rb_intern("@stream"), object);
 	}
 
-	if (convert_return == FIT_CONVERT_PROTOCOL_VERSION_NOT_SUPPORTED) {
-		sprintf(err_msg, "Protocol version not supported.\n");
-		pass_err_message(handler, err_msg);
-		return Qnil;
+	TypedData_Get_Struct(object, struct parse_stream, &parse_stream_type, stream);
+
+	if(stream->busy)
+		rb_raise(rb_eRuntimeError, "can't feed the parser from its own callbacks");
+
+	stream->busy = 1;
+	stream->done = 0;
+	return stream;
+}
+
+struct parse_stream_args {
+	VALUE self;
+	struct parse_stream *stream;
+	VALUE str;
+};
+
+static VALUE parse_stream_feed(VALUE arg) {
+	struct parse_stream_args *args = (struct parse_stream_args *) arg;
+	struct parse_stream *stream = args->stream;
+
+	// Bytes after the end of the file, or after an error, are ignored.
+	if(stream->ctx.convert_return == FIT_CONVERT_CONTINUE)
+		parse_input(&stream->ctx, RSTRING_PTR(args->str), RSTRING_LEN(args->str));
+
+	stream->done = 1;
+	return Qnil;
+}
+
+static VALUE parse_stream_finish(VALUE arg) {
+	struct parse_stream_args *args = (struct parse_stream_args *) arg;
+
+	rb_ivar_set(args->self, rb_intern("@stream"), Qnil);
+	parse_input_end(&args->stream->ctx);
+	parse_end(&args->stream->ctx);
+	args->stream->done = 1;
+	return Qnil;
+}
+
+/*
+ * A stream a callback raised out of is in the middle of a chunk; start over
+ * with the next feed.
+ */
+static VALUE parse_stream_ensure(VALUE arg) {
+	struct parse_stream_args *args = (struct parse_stream_args *) arg;
+
+	args->stream->busy = 0;
+	if(!args->stream->done)
+		rb_ivar_set(args->self, rb_intern("@stream"), Qnil);
+
+	return Qnil;
+}
+
+/*
+ * FitParser#feed(chunk), also FitParser#<<(chunk)
+ *
+ * Decodes the next bytes of a file as they arrive, passing each message to
+ * the handler as soon as it is complete.  The decoder state is kept between
+ * calls, so the file never has to be in memory as a whole.  Call finish
+ * after the last chunk.
+ */
+static VALUE feed(VALUE self, VALUE chunk) {
+	struct parse_stream_args args;
+
+	args.self = self;
+	args.str = rb_str_new_frozen(StringValue(chunk));
+	args.stream = parse_stream(self, 1);
+	rb_ensure(parse_stream_feed, (VALUE) &args, parse_stream_ensure, (VALUE) &args);
+	RB_GC_GUARD(args.str);
+	return self;
+}
+
+/*
+ * FitParser#finish
+ *
+ * Ends the file fed so far, passing the last records and reporting to the
+ * handler how the file ended, as parse does.  The next feed starts a new
+ * file.
+ */
+static VALUE finish(VALUE self) {
+	struct parse_stream_args args;
+
+	args.self = self;
+	args.str = Qnil;
+	args.stream = parse_stream(self, 1);
+	rb_ensure(parse_stream_finish, (VALUE) &args, parse_stream_ensure, (VALUE) &args);
+	return Qnil;
+}
+
+#define DEFAULT_IO_CHUNK_SIZE 65536
+
+struct parse_io_args {
+	VALUE io;
+	ID read;
+	VALUE chunk_size;
+	VALUE buffer;
+};
+
+static VALUE parse_io_read(VALUE arg) {
+	struct parse_io_args *args = (struct parse_io_args *) arg;
+
+	return rb_funcall(args->io, args->read, 2, args->chunk_size, args->buffer);
+}
+
+static VALUE parse_io_eof(VALUE arg, VALUE error) {
+	return Qnil;
+}
+
+/*
+ * FitParser#parse_io(io, chunk_size: 65536)
+ *
+ * Parses a file read from io, chunk_size bytes at a time, passing each
+ * message to the handler as soon as it is complete.  Only one chunk is held
+ * in memory.  io can be anything that responds to readpartial (or to read,
+ * like StringIO): files, pipes, sockets, ...; reads go through the Fiber
+ * scheduler when one is set, so other fibers run while waiting for data.
+ */
+static VALUE parse_io(int argc, VALUE *argv, VALUE self) {
+	VALUE io, opts;
+	struct parse_io_args args;
+	struct parse_context ctx;
+	VALUE messages;
+	long chunk_size = DEFAULT_IO_CHUNK_SIZE;
+
+	rb_scan_args(argc, argv, "1:", &io, &opts);
+
+	if(!NIL_P(opts)) {
+		ID keyword = rb_intern("chunk_size");
+		VALUE value;
+
+		rb_get_kwargs(opts, &keyword, 0, 1, &value);
+		if(value != Qundef)
+			chunk_size = NUM2LONG(value);
+		if(chunk_size < 1)
+			rb_raise(rb_eArgError, "chunk_size must be at least 1");
 	}
 
-	if (convert_return == FIT_CONVERT_END_OF_FILE) {
-		sprintf(err_msg, "File converted successfully.\n");
-		pass_message(handler, err_msg);
+	args.io = io;
+	args.read = rb_respond_to(io, rb_intern("readpartial")) ? rb_intern("readpartial") : rb_intern("read");
+	args.chunk_size = LONG2NUM(chunk_size);
+	args.buffer = rb_str_buf_new(chunk_size);
+
+	parse_begin(&ctx, self, PARSE_HANDLER, NULL);
+	ctx.messages = ALLOCV_N(struct decoded_message, messages, DECODE_CHUNK_MESSAGES);
+
+	// Nothing but this loop touches the buffer read into, so it is decoded
+	// in place.
+	while(ctx.convert_return == FIT_CONVERT_CONTINUE) {
+		VALUE chunk = rb_rescue2(parse_io_read, (VALUE) &args, parse_io_eof, Qnil, rb_eEOFError, (VALUE) 0);
+
+		if(NIL_P(chunk))
+			break;
+
+		// Decode a frozen copy of whatever else read returns, as parse does.
+		if(chunk != args.buffer)
+			chunk = rb_str_new_frozen(StringValue(chunk));
+
+		parse_input(&ctx, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+		RB_GC_GUARD(chunk);
 	}
 
+	parse_input_end(&ctx);
+	ALLOCV_END(messages);
+	parse_end(&ctx);
 	return Qnil;
 }
 
+/*
+ * FitParser#each_message(data) { |mesg_num, message| ... }
+ *
+ * Yields the global message number and the message of each message the
+ * handler would get, without calling the handler.  Decoding only goes as far
+ * as the block takes it: breaking out of it stops decoding.  Without a block,
+ * returns an Enumerator.  Raises RubyFit::ParseError if the file can't be
+ * decoded to the end.
+ */
+static VALUE each_message(VALUE self, VALUE original_str) {
+	RETURN_ENUMERATOR(self, 1, &original_str);
+	parse_data(self, rb_str_new_frozen(StringValue(original_str)), PARSE_EACH_MESSAGE, NULL);
+	return self;
+}
+
+/*
+ * FitParser#each_record(data) { |record| ... }
+ *
+ * Like each_message, but only decodes and yields records.
+ */
+static VALUE each_record(VALUE self, VALUE original_str) {
+	RETURN_ENUMERATOR(self, 1, &original_str);
+	parse_data(self, rb_str_new_frozen(StringValue(original_str)), PARSE_EACH_RECORD, NULL);
+	return self;
+}
+
+/*
+ * FitParser#parse_columns(data)
+ *
+ * Parses like parse, but instead of passing records to the handler one at a
+ * time, returns all of them as a RubyFit::RecordColumns.  Every other
+ * message is still passed to the handler.
+ */
+static VALUE parse_columns(VALUE self, VALUE original_str) {
+	VALUE str = rb_str_new_frozen(StringValue(original_str));
+	VALUE data = rb_hash_new();
+	VALUE valid = rb_hash_new();
+	struct record_column_buffers columns;
+	size_t i;
+
+	columns.size = 0;
+	for(i = 0; i < RECORD_COLUMNS; i++) {
+		columns.data[i] = rb_str_buf_new(0);
+		columns.valid[i] = rb_str_buf_new(0);
+	}
+
+	parse_data(self, str, PARSE_HANDLER, &columns);
+
+	for(i = 0; i < RECORD_COLUMNS; i++) {
+		VALUE key = message_keys[KEYS_SYMBOL][MESSAGE_RECORD][record_columns[i].field_num];
+
+		rb_hash_aset(data, key, columns.data[i]);
+		rb_hash_aset(valid, key, columns.valid[i]);
+	}
+
+	return rb_funcall(cRecordColumns, rb_intern("new"), 3, LONG2NUM(columns.size), data, valid);
+}
+
 static VALUE update_crc(VALUE self, VALUE r_crc, VALUE r_data) {
         FIT_UINT16 crc = NUM2USHORT(r_crc);
         const char* data = StringValuePtr(r_data);
-        const FIT_UINT16 byte_count = RSTRING_LEN(r_data);
-        return UINT2NUM(FitCRC_Update16(crc, data, byte_count));
+        long byte_count = RSTRING_LEN(r_data);
+
+        // FitCRC_Update16 takes a 32-bit size; strings beyond that are fed in pieces.
+        while (byte_count > 0) {
+                const FIT_UINT32 chunk = byte_count > 0x7FFFFFFFL ? 0x7FFFFFFF : (FIT_UINT32)byte_count;
+                crc = FitCRC_Update16(crc, data, chunk);
+                data += chunk;
+                byte_count -= chunk;
+        }
+
+        return UINT2NUM(crc);
+}
+
+static VALUE define_message_class(VALUE mRubyFit, size_t message) {
+	VALUE members[256];
+	VALUE klass;
+	size_t i;
+
+	for(i = 0; i < message_names[message].num_fields; i++)
+		members[i] = ID2SYM(rb_intern(message_names[message].fields[i].name));
+
+	klass = rb_funcallv(rb_cStruct, rb_intern("new"), (int) message_names[message].num_fields, members);
+	rb_define_const(mRubyFit, message_names[message].class_name, klass);
+	rb_gc_register_mark_object(klass);
+	return klass;
+}
+
+static VALUE define_lazy_message_class(size_t message) {
+	VALUE klass = rb_define_class_under(cLazyMessage, message_names[message].class_name, cLazyMessage);
+	size_t i;
+
+	for(i = 0; i < message_names[message].num_fields; i++)
+		rb_define_method(klass, message_names[message].fields[i].name, lazy_message_field, 0);
+
+	return klass;
+}
+
+static void init_messages(VALUE mRubyFit) {
+	size_t i, j;
+
+	for(i = 0; i < MESSAGES; i++) {
+		for(j = 0; j < message_names[i].num_fields; j++) {
+			const struct field_name *field = &message_names[i].fields[j];
+#if defined(HAVE_RB_INTERNED_STR_CSTR)
+			VALUE key = rb_interned_str_cstr(field->name);
+#else
+			VALUE key = rb_obj_freeze(rb_str_new_cstr(field->name));
+#endif
+
+			rb_gc_register_mark_object(key);
+			message_keys[KEYS_STRING][i][field->field_num] = key;
+			message_keys[KEYS_SYMBOL][i][field->field_num] = ID2SYM(rb_intern(field->name));
+			message_members[i][field->field_num] = j;
+			message_field_ids[i][j] = rb_intern(field->name);
+		}
+
+		message_callbacks[i] = rb_intern(message_names[i].callback);
+		message_classes[i] = define_message_class(mRubyFit, i);
+		lazy_message_classes[i] = define_lazy_message_class(i);
+	}
 }
 
 void Init_rubyfit() {
+#if defined(HAVE_RB_EXT_RACTOR_SAFE)
+	// Parsers keep all their state in the parser object or on the stack.
+	rb_ext_ractor_safe(true);
+#endif
+
         VALUE mRubyFit = rb_define_module("RubyFit");
         VALUE cFitParser = rb_define_class_under(mRubyFit, "FitParser", rb_cObject);
 
+	eParseError = rb_define_class_under(mRubyFit, "ParseError", rb_eStandardError);
+
+	cParseStream = rb_define_class_under(cFitParser, "Stream", rb_cObject);
+	rb_undef_alloc_func(cParseStream);
+
+	cLazyMessage = rb_define_class_under(mRubyFit, "LazyMessage", rb_cObject);
+	rb_define_alloc_func(cLazyMessage, lazy_message_alloc);
+	rb_undef_method(CLASS_OF(cLazyMessage), "new");
+	rb_define_method(cLazyMessage, "initialize_copy", lazy_message_init_copy, 1);
+	rb_define_method(cLazyMessage, "[]", lazy_message_aref, 1);
+	rb_define_method(cLazyMessage, "to_h", lazy_message_to_h, 0);
+
+	init_messages(mRubyFit);
+	id_on_records = rb_intern("on_records");
+	id_print_msg = rb_intern("print_msg");
+	id_print_error_msg = rb_intern("print_error_msg");
+
 	//instance methods
-	rb_define_method(cFitParser, "initialize", init, 1);
+	rb_define_method(cFitParser, "initialize", init, -1);
 	rb_define_method(cFitParser, "parse", parse, 1);
+	rb_define_method(cFitParser, "parse_file", parse_file, 1);
+	rb_define_method(cFitParser, "parse_io", parse_io, -1);
+	rb_define_method(cFitParser, "parse_zip", parse_zip, 1);
+	rb_define_method(cFitParser, "parse_columns", parse_columns, 1);
+	rb_define_method(cFitParser, "each_message", each_message, 1);
+	rb_define_method(cFitParser, "each_record", each_record, 1);
+	rb_define_method(cFitParser, "feed", feed, 1);
+	rb_define_method(cFitParser, "<<", feed, 1);
+	rb_define_method(cFitParser, "finish", finish, 0);
 
 	//attributes
 	rb_define_attr(cFitParser, "handler", 1, 1);
 
+	// Record columns, see lib/rubyfit/record_columns.rb
+	cRecordColumns = rb_define_class_under(mRubyFit, "RecordColumns", rb_cObject);
+	rb_define_const(cRecordColumns, "TYPES", record_column_types());
+
         // CRC helper
         VALUE mCRC = rb_define_module_under(mRubyFit, "CRC");
         rb_define_singleton_method(mCRC, "update_crc", update_crc, 2);
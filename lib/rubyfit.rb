@@ -1,5 +1,6 @@
 require "rubyfit/version"
 require 'rubyfit/rubyfit'
+require 'rubyfit/record_columns'
 
 require 'rubyfit/writer'
 require 'rubyfit/helpers'
@@ -14,7 +14,7 @@ module RubyFit::Helpers
       num = num.abs
 
       if num > 2 ** (byte_count * 8 - 1)
-        STDERR.puts("RubyFit WARNING: Integer underflow for #{orig_num} (#{orig_num.bit_length + 1} bits) when fitting in #{byte_count} bytes (#{byte_count * 8} bits)")
+        warn("RubyFit WARNING: Integer underflow for #{orig_num} (#{orig_num.bit_length + 1} bits) when fitting in #{byte_count} bytes (#{byte_count * 8} bits)")
       end
 
       num = 2 ** (byte_count * 8) - num
@@ -30,7 +30,7 @@ module RubyFit::Helpers
       .unpack("C*")
 
     if result.size > byte_count
-      STDERR.puts("RubyFit WARNING: Truncating #{orig_num} (#{orig_num.bit_length} bits) to fit in #{byte_count} bytes (#{byte_count * 8} bits)")
+      warn("RubyFit WARNING: Truncating #{orig_num} (#{orig_num.bit_length} bits) to fit in #{byte_count} bytes (#{byte_count * 8} bits)")
       result = result.last(byte_count)
     elsif result.size < byte_count
       pad_bytes = [0] * (byte_count - result.size)
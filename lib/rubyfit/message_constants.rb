@@ -309,4 +309,6 @@ module RubyFit::MessageConstants
     statute: 1,
     nautical: 2
   }
+
+  constants.each { |name| Ractor.make_shareable(const_get(name)) } if defined?(Ractor)
 end
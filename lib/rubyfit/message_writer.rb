@@ -205,6 +205,10 @@ class RubyFit::MessageWriter
     }
   }
 
+  # Deep-freeze the definitions, Type lambdas included, so files can be
+  # written from any Ractor
+  Ractor.make_shareable(MESSAGE_DEFINITIONS) if defined?(Ractor)
+
   def self.definition_message(type, local_num)
     pack_bytes do |bytes|
       message_data = MESSAGE_DEFINITIONS[type]
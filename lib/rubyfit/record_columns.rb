@@ -0,0 +1,61 @@
+# Every record of a FIT file, stored by field rather than by record. Returned
+# by RubyFit::FitParser#parse_columns.
+#
+# Each field is a String of packed native values, one per record, with the
+# pack directive given in TYPES (defined by the extension). A bitmap marks
+# the records that have a valid value for the field; invalid values are
+# packed as 0 and read back as nil.
+class RubyFit::RecordColumns
+  include Enumerable
+
+  attr_reader :size
+
+  def initialize(size, data, valid)
+    @size = size
+    @data = data
+    @valid = valid
+  end
+
+  def names
+    TYPES.keys
+  end
+
+  # The packed values of a field, e.g. packed(:timestamp).unpack("q*")
+  def packed(name)
+    @data.fetch(name.to_sym)
+  end
+
+  # The validity bitmap of a field, least significant bit first
+  def validity(name)
+    @valid.fetch(name.to_sym)
+  end
+
+  def valid?(name, index)
+    index >= 0 && index < size && validity(name).getbyte(index / 8)[index % 8] == 1
+  end
+
+  # The values of a field, with nil for records that don't have it
+  def [](name)
+    bits = validity(name).unpack1("b*")
+    packed(name).unpack("#{TYPES.fetch(name.to_sym)}*").each_with_index.map do |value, index|
+      bits[index] == "1" ? value : nil
+    end
+  end
+
+  def to_h
+    names.each_with_object({}) { |name, columns| columns[name] = self[name] }
+  end
+
+  # Yields each record as a hash of its valid fields, like FitParser#parse
+  # passes to on_record
+  def each
+    return enum_for(:each) { size } unless block_given?
+
+    columns = to_h
+    size.times do |index|
+      record = {}
+      columns.each { |name, values| record[name.to_s] = values[index] unless values[index].nil? }
+      yield record
+    end
+  end
+end
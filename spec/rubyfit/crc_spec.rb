@@ -14,6 +14,12 @@ describe RubyFit::CRC do
     it "takes an initialization value and updates it" do
       expect(described_class.update_crc(30715, data)).to eq(0xD506)
     end
+
+    it "uses every byte of strings longer than 65535 bytes" do
+      long_data = data * 10_000
+      chunked = long_data.bytes.each_slice(1000).inject(0) { |crc, bytes| described_class.update_crc(crc, bytes.pack("C*")) }
+      expect(described_class.update_crc(0, long_data)).to eq(chunked)
+    end
   end
 end
 
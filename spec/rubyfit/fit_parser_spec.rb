@@ -0,0 +1,660 @@
+require 'spec_helper'
+require 'stringio'
+require 'tempfile'
+require 'zlib'
+
+describe RubyFit::FitParser do
+  class RecordingCallbacks
+    attr_reader :calls
+
+    def initialize
+      @calls = []
+    end
+
+    %w(print_msg print_error_msg on_activity on_lap on_session on_record on_event
+       on_device_info on_user_profile on_weight_scale_info).each do |name|
+      define_method(name) { |msg| @calls << [name.to_sym, msg] }
+    end
+
+    def names
+      @calls.map(&:first)
+    end
+  end
+
+  let(:start_time) { Time.utc(2018, 1, 1, 12).to_i }
+  let(:track_points) {
+    [
+      {x: -122.64424, y: 45.5279, distance: 0.0, elevation: 100.0, timestamp: start_time},
+      {x: -122.64355, y: 45.5279, distance: 53.81, elevation: 110.0, timestamp: start_time + 60}
+    ]
+  }
+
+  let(:fit_data) {
+    writer = RubyFit::Writer.new
+    stream = StringIO.new
+    opts = {
+      time_created: start_time,
+      start_time: start_time,
+      duration: 60,
+      start_x: track_points.first[:x],
+      start_y: track_points.first[:y],
+      end_x: track_points.last[:x],
+      end_y: track_points.last[:y],
+      total_distance: track_points.last[:distance],
+      name: "test course",
+      track_point_count: track_points.size,
+      course_point_count: 0,
+    }
+
+    writer.write(stream, opts) do
+      writer.course_points {}
+      writer.track_points do
+        track_points.each { |data| writer.track_point(data) }
+      end
+    end
+
+    stream.string
+  }
+
+  let(:callbacks) { RecordingCallbacks.new }
+
+  def fit_file(records)
+    records = records.pack("C*")
+    header = [14, 0x10, 2127, records.size].pack("CCvV") + ".FIT"
+    header += [RubyFit::CRC.update_crc(0, header)].pack("v")
+    data = header + records
+    data + [RubyFit::CRC.update_crc(0, data)].pack("v")
+  end
+
+  it "passes every known message to the handler" do
+    described_class.new(callbacks).parse(fit_data)
+
+    expect(callbacks.names).to eq([:print_msg, :on_lap, :on_event, :on_record, :on_record, :on_event, :print_msg])
+    expect(callbacks.calls.last).to eq([:print_msg, "File converted successfully.\n"])
+  end
+
+  it "parses in several threads at once" do
+    described_class.new(callbacks).parse(fit_data)
+
+    threads = 4.times.map do
+      Thread.new do
+        thread_callbacks = RecordingCallbacks.new
+        described_class.new(thread_callbacks).parse(fit_data)
+        thread_callbacks.calls
+      end
+    end
+
+    expect(threads.map(&:value)).to eq([callbacks.calls] * 4)
+  end
+
+  it "skips messages the handler has no callback for" do
+    handler = Class.new {
+      attr_reader :records
+
+      def initialize
+        @records = []
+      end
+
+      def on_record(msg)
+        @records << msg
+      end
+    }.new
+
+    described_class.new(handler).parse(fit_data)
+
+    expect(handler.records.map { |msg| msg["timestamp"] }).to eq(track_points.map { |point| point[:timestamp] })
+  end
+
+  describe "messages option" do
+    it "only passes the requested messages to the handler" do
+      described_class.new(callbacks, messages: [:record]).parse(fit_data)
+
+      expect(callbacks.names).to eq([:on_record, :on_record, :print_msg])
+      expect(callbacks.calls.map { |_, msg| msg["timestamp"] if msg.is_a?(Hash) }.compact).to eq(track_points.map { |point| point[:timestamp] })
+      expect(callbacks.calls.last).to eq([:print_msg, "File converted successfully.\n"])
+    end
+
+    it "decodes filtered messages the same as unfiltered ones" do
+      described_class.new(callbacks).parse(fit_data)
+      unfiltered = callbacks.calls.select { |name, _| name == :on_lap || name == :on_event }
+
+      filtered_callbacks = RecordingCallbacks.new
+      described_class.new(filtered_callbacks, messages: %w(lap event)).parse(fit_data)
+
+      expect(filtered_callbacks.calls[0...-1]).to eq(unfiltered)
+    end
+
+    it "rejects unknown message names" do
+      expect { described_class.new(callbacks, messages: [:bogus]) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "fields option" do
+    def records(callbacks)
+      callbacks.calls.select { |name, _| name == :on_record }.map(&:last)
+    end
+
+    it "only passes the requested fields to the handler" do
+      described_class.new(callbacks, fields: { record: [:timestamp, :distance] }).parse(fit_data)
+
+      expect(records(callbacks)).to eq(track_points.map { |point| { "timestamp" => point[:timestamp], "distance" => point[:distance] } })
+    end
+
+    it "leaves out the timestamp when it is not requested" do
+      described_class.new(callbacks, fields: { record: [:altitude] }).parse(fit_data)
+
+      expect(records(callbacks)).to eq(track_points.map { |point| { "altitude" => point[:elevation] } })
+    end
+
+    it "leaves other messages alone" do
+      described_class.new(callbacks).parse(fit_data)
+      laps = callbacks.calls.select { |name, _| name == :on_lap }
+
+      filtered_callbacks = RecordingCallbacks.new
+      described_class.new(filtered_callbacks, fields: { record: [:distance] }).parse(fit_data)
+
+      expect(filtered_callbacks.calls.select { |name, _| name == :on_lap }).to eq(laps)
+    end
+
+    it "rejects unknown field names" do
+      expect { described_class.new(callbacks, fields: { record: [:bogus] }) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "batch_records option" do
+    class BatchingCallbacks < RecordingCallbacks
+      def on_records(msgs)
+        @calls << [:on_records, msgs]
+      end
+    end
+
+    let(:track_points) {
+      (0...5).map { |i| {x: -122.64424 + i * 0.001, y: 45.5279, distance: i * 50.0, elevation: 100.0, timestamp: start_time + i * 60} }
+    }
+
+    it "passes records in batches of the given size" do
+      described_class.new(callbacks).parse(fit_data)
+      records = callbacks.calls.select { |name, _| name == :on_record }.map(&:last)
+
+      batching_callbacks = BatchingCallbacks.new
+      described_class.new(batching_callbacks, batch_records: 2).parse(fit_data)
+
+      expect(batching_callbacks.names).to eq([:print_msg, :on_lap, :on_event, :on_records, :on_records, :on_records, :on_event, :print_msg])
+      expect(batching_callbacks.calls.select { |name, _| name == :on_records }.map(&:last)).to eq(records.each_slice(2).to_a)
+    end
+
+    it "passes records one at a time to handlers without on_records" do
+      described_class.new(callbacks, batch_records: true).parse(fit_data)
+
+      expect(callbacks.names.count(:on_record)).to eq(track_points.size)
+    end
+
+    it "rejects batch sizes below one" do
+      expect { described_class.new(callbacks, batch_records: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "reuse_messages option" do
+    class CopyingCallbacks < RecordingCallbacks
+      attr_reader :hashes
+
+      %w(on_lap on_record on_event).each do |name|
+        define_method(name) do |msg|
+          (@hashes ||= []) << msg
+          @calls << [name.to_sym, msg.dup]
+        end
+      end
+    end
+
+    it "passes the same messages" do
+      described_class.new(callbacks).parse(fit_data)
+
+      copying_callbacks = CopyingCallbacks.new
+      described_class.new(copying_callbacks, reuse_messages: true).parse(fit_data)
+
+      expect(copying_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "passes one hash per message type" do
+      copying_callbacks = CopyingCallbacks.new
+      described_class.new(copying_callbacks, reuse_messages: true).parse(fit_data)
+
+      expect(copying_callbacks.hashes.map(&:object_id).uniq.size).to eq(3)
+    end
+  end
+
+  describe "structs option" do
+    def as_hash(msg)
+      msg.is_a?(Struct) ? msg.to_h.compact.transform_keys(&:to_s) : msg
+    end
+
+    it "passes each message as a Struct of its type" do
+      described_class.new(callbacks, structs: true).parse(fit_data)
+      messages = callbacks.calls.reject { |name, _| name == :print_msg }
+
+      expect(messages.map { |name, msg| [name, msg.class] }).to eq([
+        [:on_lap, RubyFit::Lap], [:on_event, RubyFit::Event], [:on_record, RubyFit::Record],
+        [:on_record, RubyFit::Record], [:on_event, RubyFit::Event]
+      ])
+    end
+
+    it "passes the same values as hashes, with nil for absent fields" do
+      described_class.new(callbacks).parse(fit_data)
+
+      struct_callbacks = RecordingCallbacks.new
+      described_class.new(struct_callbacks, structs: true).parse(fit_data)
+
+      expect(struct_callbacks.calls.map { |name, msg| [name, as_hash(msg)] }).to eq(callbacks.calls)
+      expect(struct_callbacks.calls.find { |name, _| name == :on_record }.last.heart_rate).to be_nil
+    end
+
+    it "can reuse one Struct per message type" do
+      described_class.new(callbacks, structs: true).parse(fit_data)
+      expected = callbacks.calls.map { |name, msg| [name, as_hash(msg)] }
+
+      copying_callbacks = CopyingCallbacks.new
+      described_class.new(copying_callbacks, structs: true, reuse_messages: true).parse(fit_data)
+
+      expect(copying_callbacks.calls.map { |name, msg| [name, as_hash(msg)] }).to eq(expected)
+      expect(copying_callbacks.hashes.map(&:object_id).uniq.size).to eq(3)
+    end
+  end
+
+  describe "lazy option" do
+    it "passes each message as a LazyMessage of its type" do
+      described_class.new(callbacks, lazy: true).parse(fit_data)
+      messages = callbacks.calls.reject { |name, _| name == :print_msg }
+
+      expect(messages.map { |name, msg| [name, msg.class] }).to eq([
+        [:on_lap, RubyFit::LazyMessage::Lap], [:on_event, RubyFit::LazyMessage::Event], [:on_record, RubyFit::LazyMessage::Record],
+        [:on_record, RubyFit::LazyMessage::Record], [:on_event, RubyFit::LazyMessage::Event]
+      ])
+    end
+
+    it "converts the same values as hashes" do
+      described_class.new(callbacks).parse(fit_data)
+
+      lazy_callbacks = RecordingCallbacks.new
+      described_class.new(lazy_callbacks, lazy: true).parse(fit_data)
+
+      expect(lazy_callbacks.calls.map { |name, msg| [name, msg.is_a?(RubyFit::LazyMessage) ? msg.to_h : msg] }).to eq(callbacks.calls)
+    end
+
+    it "reads single fields by name or accessor" do
+      described_class.new(callbacks, lazy: true).parse(fit_data)
+      records = callbacks.calls.select { |name, _| name == :on_record }.map(&:last)
+
+      expect(records.map(&:timestamp)).to eq(track_points.map { |point| point[:timestamp] })
+      expect(records.map { |record| record[:altitude] }).to eq(track_points.map { |point| point[:elevation] })
+      expect(records.first["distance"]).to eq(track_points.first[:distance])
+      expect(records.first.heart_rate).to be_nil
+      expect(records.first[:bogus]).to be_nil
+    end
+
+    it "can reuse one LazyMessage per message type" do
+      described_class.new(callbacks).parse(fit_data)
+
+      copying_callbacks = CopyingCallbacks.new
+      described_class.new(copying_callbacks, lazy: true, reuse_messages: true).parse(fit_data)
+
+      expect(copying_callbacks.calls.map { |name, msg| [name, msg.is_a?(RubyFit::LazyMessage) ? msg.to_h : msg] }).to eq(callbacks.calls)
+      expect(copying_callbacks.hashes.map(&:object_id).uniq.size).to eq(3)
+    end
+
+    it "can't be combined with structs" do
+      expect { described_class.new(callbacks, lazy: true, structs: true) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "#each_message" do
+    it "yields the messages the handler would get, with their message numbers" do
+      described_class.new(callbacks).parse(fit_data)
+      expected = callbacks.calls.reject { |name, _| name == :print_msg }.map(&:last)
+
+      handler = RecordingCallbacks.new
+      messages = described_class.new(handler).each_message(fit_data).to_a
+
+      expect(messages.map(&:last)).to eq(expected)
+      expect(messages.map(&:first)).to eq([19, 21, 20, 20, 21])
+      expect(handler.calls).to eq([])
+    end
+
+    it "stops decoding when the block breaks" do
+      yielded = 0
+      described_class.new(callbacks).each_message(fit_data) { |_, _| yielded += 1; break }
+
+      expect(yielded).to eq(1)
+    end
+
+    it "raises ParseError for a truncated file" do
+      expect { described_class.new(callbacks).each_message(fit_data[0, fit_data.size - 4]).to_a }.to raise_error(RubyFit::ParseError)
+    end
+  end
+
+  describe "#each_record" do
+    it "returns an Enumerator over the records" do
+      described_class.new(callbacks).parse(fit_data)
+      records = callbacks.calls.select { |name, _| name == :on_record }.map(&:last)
+
+      enum = described_class.new(callbacks).each_record(fit_data)
+
+      expect(enum).to be_a(Enumerator)
+      expect(enum.to_a).to eq(records)
+      expect(enum.first["timestamp"]).to eq(start_time)
+    end
+  end
+
+  describe "#feed" do
+    it "passes the same messages as parse, whatever the chunk size" do
+      described_class.new(callbacks).parse(fit_data)
+
+      [1, 3, 64, fit_data.size].each do |size|
+        chunk_callbacks = RecordingCallbacks.new
+        parser = described_class.new(chunk_callbacks)
+        fit_data.bytes.each_slice(size) { |chunk| parser << chunk.pack("C*") }
+        parser.finish
+
+        expect(chunk_callbacks.calls).to eq(callbacks.calls)
+      end
+    end
+
+    it "skips zero-size fields the same way as parse" do
+      # Record with timestamp, a zero-size heart_rate and position_lat.
+      data = fit_file([0x40, 0, 0, 20, 0, 3, 253, 4, 0x86, 3, 0, 0x02, 0, 4, 0x85,
+                       0x00, 0x20, 0x56, 0x97, 0x35, 0x15, 0x16, 0x17, 0x07])
+      described_class.new(callbacks).parse(data)
+
+      chunk_callbacks = RecordingCallbacks.new
+      parser = described_class.new(chunk_callbacks)
+      data.each_char { |byte| parser << byte }
+      parser.finish
+
+      expect(callbacks.names).to include(:on_record)
+      expect(chunk_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "reports data for a local message that was never defined, like parse" do
+      data = fit_file([0x40, 0, 0, 20, 0, 1, 253, 4, 0x86,
+                       0x00, 0x20, 0x56, 0x97, 0x35, 0x01, 0x15, 0x16, 0x17, 0x07])
+      described_class.new(callbacks).parse(data)
+
+      feed_callbacks = RecordingCallbacks.new
+      described_class.new(feed_callbacks).feed(data).finish
+
+      expect(callbacks.calls.last).to eq([:print_error_msg, "Error decoding file.\n"])
+      expect(feed_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "passes messages as soon as they are complete" do
+      parser = described_class.new(callbacks)
+      parser.feed(fit_data[0, fit_data.size - 2])
+
+      expect(callbacks.names.count(:on_record)).to eq(track_points.size)
+      expect(callbacks.calls).not_to include([:print_msg, "File converted successfully.\n"])
+    end
+
+    it "starts a new file after finish" do
+      parser = described_class.new(callbacks)
+      parser.feed(fit_data[0, 20]).finish
+      expect(callbacks.calls.last).to eq([:print_error_msg, "Unexpected end of file.\n"])
+
+      parser.feed(fit_data).finish
+      expect(callbacks.calls.last).to eq([:print_msg, "File converted successfully.\n"])
+    end
+
+    it "can't be called from a callback" do
+      handler = Class.new {
+        attr_accessor :parser
+
+        def on_lap(msg)
+          parser << "x"
+        end
+      }.new
+      handler.parser = described_class.new(handler)
+
+      expect { handler.parser << fit_data }.to raise_error(RuntimeError)
+    end
+  end
+
+  describe "#parse_file" do
+    it "passes the same messages as parse" do
+      described_class.new(callbacks).parse(fit_data)
+
+      Tempfile.create(["course", ".fit"]) do |file|
+        file.binmode
+        file.write(fit_data)
+        file.close
+
+        file_callbacks = RecordingCallbacks.new
+        described_class.new(file_callbacks).parse_file(file.path)
+
+        expect(file_callbacks.calls).to eq(callbacks.calls)
+      end
+    end
+
+    it "raises for missing files" do
+      expect { described_class.new(callbacks).parse_file("/nonexistent/course.fit") }.to raise_error(Errno::ENOENT)
+    end
+  end
+
+  describe "#parse_io" do
+    it "passes the same messages as parse" do
+      described_class.new(callbacks).parse(fit_data)
+
+      io_callbacks = RecordingCallbacks.new
+      described_class.new(io_callbacks).parse_io(StringIO.new(fit_data), chunk_size: 7)
+
+      expect(io_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "reads from pipes as data arrives" do
+      described_class.new(callbacks).parse(fit_data)
+
+      reader, writer = IO.pipe
+      thread = Thread.new do
+        fit_data.bytes.each_slice(16) { |chunk| writer.write(chunk.pack("C*")) }
+        writer.close
+      end
+
+      io_callbacks = RecordingCallbacks.new
+      described_class.new(io_callbacks).parse_io(reader)
+      thread.join
+
+      expect(io_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "rejects chunk sizes below one" do
+      expect { described_class.new(callbacks).parse_io(StringIO.new(fit_data), chunk_size: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "gzip compressed files" do
+    let(:gzip_data) { Zlib.gzip(fit_data) }
+
+    before { described_class.new(callbacks).parse(fit_data) }
+
+    it "are inflated by parse" do
+      gzip_callbacks = RecordingCallbacks.new
+      described_class.new(gzip_callbacks).parse(gzip_data)
+
+      expect(gzip_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "are inflated by feed, whatever the chunk size" do
+      gzip_callbacks = RecordingCallbacks.new
+      parser = described_class.new(gzip_callbacks)
+      gzip_data.each_char { |byte| parser << byte }
+      parser.finish
+
+      expect(gzip_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "are inflated by parse_io" do
+      gzip_callbacks = RecordingCallbacks.new
+      described_class.new(gzip_callbacks).parse_io(StringIO.new(gzip_data), chunk_size: 16)
+
+      expect(gzip_callbacks.calls).to eq(callbacks.calls)
+    end
+
+    it "report truncated files" do
+      gzip_callbacks = RecordingCallbacks.new
+      described_class.new(gzip_callbacks).parse(gzip_data[0, gzip_data.size / 2])
+
+      expect(gzip_callbacks.calls.last).to eq([:print_error_msg, "Unexpected end of file.\n"])
+    end
+  end
+
+  describe "#parse_zip" do
+    # A ZIP archive of [name, data, deflate] entries.  With zip64, sizes and
+    # offsets are only in the zip64 extra fields and end of central directory.
+    def zip(entries, zip64: false)
+      archive = "".b
+      central = "".b
+
+      entries.each do |name, data, deflate|
+        stored = deflate ? Zlib::Deflate.new(Zlib::DEFAULT_COMPRESSION, -Zlib::MAX_WBITS).deflate(data, Zlib::FINISH) : data
+        fields = [deflate ? 8 : 0, 0, 0, Zlib.crc32(data), stored.size, data.size, name.bytesize, 0]
+
+        if zip64
+          extra = [0x0001, 24, data.size, stored.size, archive.size].pack("vvQ<Q<Q<")
+          central << [0x02014b50, 45, 45, 0, *fields[0, 4], 0xFFFFFFFF, 0xFFFFFFFF, name.bytesize, extra.size, 0, 0, 0, 0, 0xFFFFFFFF].pack("VvvvvvvVVVvvvvvVV") << name.b << extra
+        else
+          central << [0x02014b50, 20, 20, 0, *fields, 0, 0, 0, 0, archive.size].pack("VvvvvvvVVVvvvvvVV") << name.b
+        end
+        archive << [0x04034b50, 20, 0, *fields].pack("VvvvvvVVVvv") << name.b << stored.b
+      end
+
+      return archive + central + [0x06054b50, 0, 0, entries.size, entries.size, central.size, archive.size, 0].pack("VvvvvVVv") unless zip64
+
+      eocd64 = [0x06064b50, 44, 45, 45, 0, 0, entries.size, entries.size, central.size, archive.size].pack("VQ<vvVVQ<Q<Q<Q<")
+      locator = [0x07064b50, 0, archive.size + central.size, 1].pack("VVQ<V")
+      archive + central + eocd64 + locator + [0x06054b50, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0].pack("VvvvvVVv")
+    end
+
+    def parse_zip_files(data)
+      zip_callbacks = RecordingCallbacks.new
+      files = {}
+
+      parse_zip(data) do |path|
+        described_class.new(zip_callbacks).parse_zip(path) do |name|
+          files[name] = zip_callbacks.calls.dup
+          zip_callbacks.calls.clear
+        end
+      end
+
+      files
+    end
+
+    def parse_zip(data)
+      Tempfile.create(["export", ".zip"]) do |file|
+        file.binmode
+        file.write(data)
+        file.close
+
+        yield file.path
+      end
+    end
+
+    it "parses each FIT file in the archive, yielding its name" do
+      described_class.new(callbacks).parse(fit_data)
+
+      entries = [["stored.fit", fit_data, false], ["notes.txt", "hi", false], ["deflated.fit", fit_data, true], ["compressed.fit.gz", Zlib.gzip(fit_data), false],
+                 ["deflated.fit.gz", Zlib.gzip(fit_data), true]]
+      files = parse_zip_files(zip(entries))
+
+      expect(files.keys).to eq(%w(stored.fit deflated.fit compressed.fit.gz deflated.fit.gz))
+      expect(files.values).to eq([callbacks.calls] * 4)
+    end
+
+    it "reads zip64 archives" do
+      described_class.new(callbacks).parse(fit_data)
+
+      files = parse_zip_files(zip([["stored.fit", fit_data, false], ["deflated.fit", fit_data, true]], zip64: true))
+
+      expect(files).to eq("stored.fit" => callbacks.calls, "deflated.fit" => callbacks.calls)
+    end
+
+    it "reports files that aren't FIT files" do
+      files = parse_zip_files(zip([["bogus.fit", "\x0e\x10" + "x" * 20, false]]))
+
+      expect(files["bogus.fit"]).to eq([[:print_error_msg, "Data type not supported.\n"]])
+    end
+
+    it "raises ParseError for files that aren't ZIP archives" do
+      parse_zip(fit_data) do |path|
+        expect { described_class.new(callbacks).parse_zip(path) }.to raise_error(RubyFit::ParseError)
+      end
+    end
+  end
+
+  if defined?(IO::Buffer)
+    describe "#parse with an IO::Buffer" do
+      it "passes the same messages as with a String" do
+        described_class.new(callbacks).parse(fit_data)
+
+        buffer_callbacks = RecordingCallbacks.new
+        buffer = IO::Buffer.for(fit_data)
+        described_class.new(buffer_callbacks).parse(buffer)
+
+        expect(buffer_callbacks.calls).to eq(callbacks.calls)
+        expect(buffer.locked?).to eq(false)
+      end
+    end
+  end
+
+  describe "#parse_columns" do
+    def records(callbacks)
+      callbacks.calls.select { |name, _| name == :on_record }.map(&:last)
+    end
+
+    it "returns the same records that parse passes to on_record" do
+      described_class.new(callbacks).parse(fit_data)
+
+      columns = described_class.new(RecordingCallbacks.new).parse_columns(fit_data)
+
+      expect(columns.size).to eq(track_points.size)
+      expect(columns.to_a).to eq(records(callbacks))
+    end
+
+    it "packs each field" do
+      columns = described_class.new(callbacks).parse_columns(fit_data)
+
+      expect(columns.packed(:timestamp).unpack("q*")).to eq(track_points.map { |point| point[:timestamp] })
+      expect(columns[:distance]).to eq(track_points.map { |point| point[:distance] })
+    end
+
+    it "marks missing values as invalid" do
+      columns = described_class.new(callbacks).parse_columns(fit_data)
+
+      expect(columns[:heart_rate]).to eq([nil] * track_points.size)
+      expect(columns.valid?(:heart_rate, 0)).to eq(false)
+      expect(columns.valid?(:altitude, 0)).to eq(true)
+    end
+
+    it "passes every other message to the handler" do
+      described_class.new(callbacks).parse_columns(fit_data)
+
+      expect(callbacks.names).to eq([:print_msg, :on_lap, :on_event, :on_event, :print_msg])
+    end
+  end
+
+  describe "symbolize_keys option" do
+    it "passes messages with String keys by default" do
+      described_class.new(callbacks).parse(fit_data)
+      record = callbacks.calls.find { |name, _| name == :on_record }.last
+
+      expect(record.keys.map(&:class).uniq).to eq([String])
+      expect(record.keys.all?(&:frozen?)).to eq(true)
+    end
+
+    it "passes messages with Symbol keys" do
+      described_class.new(callbacks).parse(fit_data)
+      expected = callbacks.calls.map { |name, msg| [name, msg.is_a?(Hash) ? msg.transform_keys(&:to_sym) : msg] }
+
+      symbol_callbacks = RecordingCallbacks.new
+      described_class.new(symbol_callbacks, symbolize_keys: true).parse(fit_data)
+
+      expect(symbol_callbacks.calls).to eq(expected)
+    end
+  end
+end
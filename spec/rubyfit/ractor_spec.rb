@@ -0,0 +1,72 @@
+require 'spec_helper'
+require 'stringio'
+
+if defined?(Ractor)
+  # Writes a course; a module method so every Ractor can call it
+  module RactorCourse
+    def self.write(track_points)
+      writer = RubyFit::Writer.new
+      stream = StringIO.new
+      start_time = track_points.first[:timestamp]
+
+      opts = {
+        time_created: start_time,
+        start_time: start_time,
+        duration: 60,
+        start_x: track_points.first[:x],
+        start_y: track_points.first[:y],
+        end_x: track_points.last[:x],
+        end_y: track_points.last[:y],
+        total_distance: track_points.last[:distance],
+        name: "ractor course",
+        track_point_count: track_points.size,
+        course_point_count: 0,
+      }
+
+      writer.write(stream, opts) do
+        writer.course_points {}
+        writer.track_points do
+          track_points.each { |data| writer.track_point(data) }
+        end
+      end
+
+      stream.string
+    end
+  end
+
+  describe "RubyFit in Ractors" do
+    class RactorCallbacks
+      attr_reader :records
+
+      def initialize
+        @records = []
+      end
+
+      def on_record(msg)
+        @records << msg
+      end
+    end
+
+    let(:track_points) {
+      start_time = Time.utc(2018, 1, 1, 12).to_i
+      (0...10).map { |i| {x: -122.64424 + i * 0.001, y: 45.5279, distance: i * 50.0, elevation: 100.0, timestamp: start_time + i * 60} }
+    }
+
+    it "parses and writes files from several Ractors at once" do
+      expected = RactorCallbacks.new
+      RubyFit::FitParser.new(expected).parse(RactorCourse.write(track_points))
+
+      ractors = 4.times.map do
+        Ractor.new(track_points) do |points|
+          data = RactorCourse.write(points)
+          callbacks = RactorCallbacks.new
+          RubyFit::FitParser.new(callbacks).parse(data)
+          [RubyFit::CRC.update_crc(0, data), callbacks.records]
+        end
+      end
+
+      crc = RubyFit::CRC.update_crc(0, RactorCourse.write(track_points))
+      expect(ractors.map(&:take)).to eq([[crc, expected.records]] * 4)
+    end
+  end
+end